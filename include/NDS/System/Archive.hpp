@@ -7,14 +7,23 @@ class Archive
 {
 private:
     FileSystem mFS;
+    bool mDeduplicate { false };
+
+    void Parse(bStream::CStream& stream, std::function<std::shared_ptr<File>(uint32_t id, uint32_t start, uint32_t end)> member);
 
 public:
+    // Identical members share one copy in the saved archive
+    void SetDeduplicate(bool deduplicate) { mDeduplicate = deduplicate; }
+
     void SaveArchive(bStream::CStream& stream);
     size_t GetFileCount() { return mFS.mFiles.size(); }
     std::shared_ptr<File> GetFileByIndex(size_t index);
-    void Dump();
+    // The tree goes under out_path with its manifest at the root, never the working directory
+    bool Dump(std::filesystem::path out_path, uint32_t threads = 0);
+    bool Dump(uint32_t threads = 0) { return Dump("archive", threads); }
     Archive(FileSystem fs) { mFS = fs; }
     Archive(bStream::CStream& stream);
+    Archive(std::shared_ptr<File> file); // members are slices of file, nothing is copied
     ~Archive();
 };
 
@@ -0,0 +1,53 @@
+#pragma once
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+namespace Palkia::Nitro {
+
+class File;
+
+// Process wide accounting for payloads read out of source images through File::Lease, by
+// files a Rom opened with LoadMode::Lazy. Once they add up to more than the budget the least
+// recently used ones are dropped and get read again next time they're leased. Eviction is
+// opt in that way: GetData keeps whatever it loads until SetData, so the pointers it hands
+// out stay valid, and that payload isn't counted here. Neither is anything changed, mapped
+// or copied in, the kernel already pages mappings and the rest have nowhere to be read back
+// from. Slices of a lazily opened file read and count their own copy. Archive, the codecs,
+// saving and dumping only read through Lease or ReadBytes, so nothing stays loaded outside
+// the budget unless the caller asked GetData for it.
+class PayloadCache {
+	friend File;
+
+	static std::mutex sLock;
+	static std::list<File*> sRecent; // most recently used first
+	static std::atomic<std::size_t> sBudget;
+	static std::size_t sBytes;
+	static std::size_t sPeakBytes;
+	static std::atomic<uint64_t> sHits;
+	static uint64_t sMisses;
+	static uint64_t sEvictions;
+
+	static void Loaded(File* file); // file's load lock is held
+	static void Touch(File* file);
+	static void Forget(File* file);
+	static void Evict(File* keep);
+
+public:
+	struct Stats {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+		std::size_t bytes; // resident right now
+		std::size_t peakBytes;
+		std::size_t budget;
+	};
+
+	// 0 is unlimited, which is the default. Lowering it evicts straight away.
+	static void SetBudget(std::size_t bytes);
+	static Stats GetStats();
+	static void ResetStats();
+};
+
+}
@@ -3,7 +3,46 @@
 
 namespace Palkia::Nitro::Compression {
 
-    void BLZDecompress(std::shared_ptr<File> target);
-    void BLZCompress(std::shared_ptr<File> target);
+    // How hard the LZ compressors look for matches
+    enum class Level {
+        Fast,   // greedy, short hash chains
+        Normal, // lazy, checks whether waiting a byte finds a longer match
+        Max,    // lazy, searches the whole window
+        Optimal // cheapest parse over every match, slowest but smallest
+    };
 
-}
\ No newline at end of file
+    // Expands a backward LZ file in place in one buffer of its final size. Files without a
+    // compressed region are left as they are, invalid ones are left alone and return false.
+    bool BLZDecompress(std::shared_ptr<File> target);
+
+    // Backward LZ as used for arm9 and overlays, undone by BLZDecompress. The start of the file
+    // is left raw where compressing it wouldn't pay off or would break decompressing in place,
+    // and at least rawPrefix bytes always are (0x4000 keeps arm9's secure area readable).
+    // Returns false and leaves the file alone if it wouldn't get any smaller.
+    // Optimal searches for matches with up to threads workers, 0 for one per core.
+    bool BLZCompress(std::shared_ptr<File> target, Level level = Level::Normal, uint32_t rawPrefix = 0, uint32_t threads = 0);
+
+    // LZ77 as the BIOS has it (type 0x10), and the 0x11 variant with longer matches. Both start
+    // with the type byte and a 24 bit decompressed size. Decompressing returns false and leaves
+    // the file alone on data that isn't valid. Compressed files never use a displacement of 1,
+    // so they're also safe for the BIOS's 16 bit VRAM decoder.
+    bool LZ10Decompress(std::shared_ptr<File> target);
+    bool LZ11Decompress(std::shared_ptr<File> target);
+    void LZ10Compress(std::shared_ptr<File> target, Level level = Level::Normal, uint32_t threads = 0);
+    void LZ11Compress(std::shared_ptr<File> target, Level level = Level::Normal, uint32_t threads = 0);
+
+    // BIOS Huffman over 4 or 8 bit symbols (types 0x24 and 0x28), decoded through a lookup table
+    // several bits at a time. Compressing fails if the tree can't be stored in the BIOS's
+    // format, whose 6 bit child offsets don't fit every shape.
+    bool HuffmanDecompress(std::shared_ptr<File> target);
+    bool HuffmanCompress(std::shared_ptr<File> target, uint8_t symbolBits = 8);
+
+    // BIOS run length encoding (type 0x30)
+    bool RLEDecompress(std::shared_ptr<File> target);
+    void RLECompress(std::shared_ptr<File> target);
+
+    // Decompresses whichever of the headered formats above the file starts with. False when it
+    // doesn't look like any of them. BLZ has no header, overlays say whether they use it.
+    bool AutoDecompress(std::shared_ptr<File> target);
+
+}
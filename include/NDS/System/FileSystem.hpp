@@ -1,11 +1,22 @@
 #pragma once
 #include <map>
+#include <span>
 #include <string>
 #include <vector>
+#include <list>
+#include <mutex>
+#include <atomic>
 #include <memory>
 #include <bstream/bstream.h>
 #include <filesystem>
 #include <functional>
+#include <iterator>
+#include <ranges>
+#include <unordered_map>
+#include "NDS/System/Image.hpp"
+#include "NDS/System/Cache.hpp"
+#include "NDS/System/Glob.hpp"
+#include "NDS/System/Manifest.hpp"
 
 namespace Palkia::Nitro {
 
@@ -14,77 +25,273 @@ class FileSystem;
 class Archive;
 
 class File : public std::enable_shared_from_this<File> {
+	friend PayloadCache;
+	friend class Snapshot;
+
 	uint16_t mID;
 	std::string mName;
 	uint32_t mSize { 0 };
 	uint8_t* mData { nullptr };
+	std::shared_ptr<void> mStorage { nullptr }; // owns mData, or keeps the image mData points into alive
+	bool mOwnsData { false };
+	bool mDirty { false }; // changed since it was last written back to its source
+
+	// where the payload lives in the source image, cleared once the data is replaced
+	std::shared_ptr<Image> mSource { nullptr };
+	uint32_t mSourceOffset { 0 };
+	bool mMatchesSource { true }; // false after an in-place edit, the image still has the old bytes
+	std::shared_ptr<File> mSliceOf { nullptr }; // shares this one's mapped bytes, so its edits are ours too
+
+	uint64_t mHash { 0 };
+	bool mHashed { false };
+
+	// A Snapshot views the payload, it's copied before it's next handed out for writing
+	std::atomic<bool> mShared { false };
+
+	mutable std::mutex mLoadLock; // only one reader gets to load a lazy file, and none while it's evicted
+
+	// Read for Lease alone and only reachable through it, the one payload PayloadCache may
+	// drop. In the cache while mCached is set.
+	std::shared_ptr<uint8_t[]> mLeased { nullptr };
+	std::atomic<bool> mCached { false };
+	std::list<File*>::iterator mCacheEntry;
+
+	uint8_t* LoadedData() const { return std::atomic_ref<uint8_t*>(const_cast<uint8_t*&>(mData)).load(std::memory_order_acquire); }
+	uint8_t* Materialize();
+	bool Load(); // mLoadLock held
+	uint8_t* Unshare();
+	void DropCache() { if(mCached) PayloadCache::Forget(this); mLeased = nullptr; }
+
+	uint8_t* Data(){
+		uint8_t* data = LoadedData();
+		if(data == nullptr && mSource != nullptr){
+			return Materialize();
+		}
+		return data;
+	}
 
 public:
 
-	uint32_t GetSize() { return mSize; }
-	uint8_t* GetData(){ return mData; }
+	uint32_t GetSize() const { return mSize; }
+
+	// For editing in place, a payload a Snapshot still views is copied first
+	uint8_t* GetData() { return mShared ? Unshare() : Data(); }
+
+	// Reading is safe from any number of threads as long as nothing changes the file,
+	// the first one to ask loads a lazy file and the rest wait for it. The payload is then
+	// kept until SetData, so the pointer stays valid whatever the PayloadCache does. Null
+	// when a lazily opened file couldn't be read from its image.
+	const uint8_t* GetData() const { return const_cast<File*>(this)->Data(); }
+
+	// Payload that stays valid for as long as it's held. A lazily opened file that nothing
+	// has called GetData on is read into the PayloadCache, which may drop it again once the
+	// lease is let go. Null when it couldn't be read, like GetData.
+	std::shared_ptr<const uint8_t> Lease();
+	std::shared_ptr<const uint8_t> Lease() const { return const_cast<File*>(this)->Lease(); }
+
+	// false while a lazily opened file hasn't been read yet
+	bool IsLoaded() const { return LoadedData() != nullptr || mSource == nullptr; }
+
+	// Image the payload can be copied straight out of, starting at GetSourceOffset().
+	// Null for files that were copied in or have been changed since.
+	std::shared_ptr<Image> GetSource() { return mMatchesSource && (mSliceOf == nullptr || mSliceOf->GetSource() != nullptr) ? mSource : nullptr; }
+	uint32_t GetSourceOffset() { return mSourceOffset; }
+
+	// Image the payload was opened from, still set once it's been changed. The file may go
+	// on reading from or mapping it until its data is replaced.
+	std::shared_ptr<Image> GetOrigin() { return mSource; }
+
+	// Copies part of the payload out without loading the whole file
+	bool ReadBytes(uint32_t offset, uint8_t* dst, uint32_t size) const;
+
+	// Hash64 of the payload, worked out on first use and kept until SetData or MarkDirty.
+	// A lazily opened file is streamed rather than loaded, 0 if it can't be read.
+	uint64_t GetHash();
+	bool ContentEquals(std::shared_ptr<File> other);
 
 	void SetID(uint16_t id) { mID = id; }
-	uint16_t GetID() { return mID; }
+	uint16_t GetID() const { return mID; }
 	void SetName(std::string name) { mName = name; }
 
+	// Always copies, so a file viewing a mapped image gets its own buffer here
 	void SetData(uint8_t* data, std::size_t size);
 
-	std::string GetName() { return mName; }
+	// Takes the buffer over instead of copying it
+	void SetData(std::vector<uint8_t>&& data);
+	void SetData(std::unique_ptr<uint8_t[]> data, std::size_t size);
+	bool OwnsData() { return mOwnsData; }
+
+	// SetData marks the file, call MarkDirty after editing GetData() in place
+	bool IsDirty() { return mDirty; }
+	void MarkDirty() { if(mShared) Unshare(); DropCache(); mDirty = true; mMatchesSource = false; mHashed = false; }
+	void ClearDirty() { mDirty = false; }
+
+	const std::string& GetName() const { return mName; }
+
+	// Writes the payload out to path, copied by the kernel from the source image when untouched
+	bool Export(std::filesystem::path path);
 
 	static std::shared_ptr<File> Create() { return std::make_shared<File>(); }
 
+	// Whole file from disk, named after it. Large files are mapped rather than read.
+	static std::shared_ptr<File> Import(std::filesystem::path path);
+
     static std::shared_ptr<File> Load(bStream::CStream& strm, uint32_t id,  uint32_t start, uint32_t end){
         std::shared_ptr<File> f = std::make_shared<File>();
 
+		std::shared_ptr<uint8_t[]> buffer = std::make_shared_for_overwrite<uint8_t[]>(end - start);
+
 		f->mID = id;
 
 		f->mName = std::format("{}.bin", id);
-		f->mData = new uint8_t[end - start];
+		f->mData = buffer.get();
 		f->mSize = end - start;
+		f->mStorage = buffer;
+		f->mOwnsData = true;
 
 		strm.seek(start);
 		strm.readBytesTo(f->mData, f->mSize);
 
 		return f;
     }
+
+	// Non-owning view of [start, end) in a loaded image, nothing is copied
+    static std::shared_ptr<File> Map(std::shared_ptr<Image> image, uint32_t id, uint32_t start, uint32_t end){
+        std::shared_ptr<File> f = std::make_shared<File>();
+
+		if(end > image->GetSize()) end = image->GetSize();
+		if(start > end) start = end;
+
+		f->mID = id;
+
+		f->mName = std::format("{}.bin", id);
+		f->mData = image->GetData() + start;
+		f->mSize = end - start;
+		f->mStorage = image;
+		f->mSource = image;
+		f->mSourceOffset = start;
+
+		return f;
+    }
+
+	// [start, end) of another file's payload, nothing is copied. A slice of an untouched file
+	// from a mapped image views the same mapping, one from an unmapped image is read lazily on
+	// its own. Otherwise it shares the parent's storage. In-place edits to the parent show
+	// through unless the slice reads its own copy, SetData gives the slice its own buffer.
+	static std::shared_ptr<File> Slice(std::shared_ptr<File> parent, uint32_t id, uint32_t start, uint32_t end){
+		if(end > parent->mSize) end = parent->mSize;
+		if(start > end) start = end;
+
+		if(std::shared_ptr<Image> source = parent->GetSource()){
+			if(!source->IsMapped()){
+				return Lazy(source, id, parent->mSourceOffset + start, parent->mSourceOffset + end);
+			}
+
+			// the parent being edited in place edits these bytes too, which the image won't have
+			std::shared_ptr<File> f = Map(source, id, parent->mSourceOffset + start, parent->mSourceOffset + end);
+			f->mSliceOf = parent;
+			return f;
+		}
+
+		std::shared_ptr<File> f = std::make_shared<File>();
+		uint8_t* data = parent->Data();
+
+		f->mID = id;
+
+		f->mName = std::format("{}.bin", id);
+		f->mData = data != nullptr ? data + start : nullptr;
+		f->mSize = end - start;
+		f->mStorage = parent->mStorage;
+
+		return f;
+	}
+
+	// Only records where the payload is, it gets read on the first GetData
+    static std::shared_ptr<File> Lazy(std::shared_ptr<Image> image, uint32_t id, uint32_t start, uint32_t end){
+        std::shared_ptr<File> f = std::make_shared<File>();
+
+		if(end > image->GetSize()) end = image->GetSize();
+		if(start > end) start = end;
+
+		f->mID = id;
+
+		f->mName = std::format("{}.bin", id);
+		f->mSize = end - start;
+		f->mSource = image;
+		f->mSourceOffset = start;
+
+		return f;
+    }
         
     std::shared_ptr<File> GetPtr(){
         return shared_from_this();
     }
 
 	File() {}
-	~File() {
-		if(mData != nullptr){
-			delete[] mData;
-		}
-	}
+	~File() { DropCache(); }
+};
+
+class Folder;
+
+// Full path (no leading slash, "/" separated) to every file and folder under a root,
+// plus every file by FAT ID. Shared between a FileSystem and its folders so AddFile/AddFolder
+// keep it current, files added that way get the next free ID.
+struct PathIndex {
+	std::unordered_map<std::string, std::weak_ptr<File>> files;
+	std::unordered_map<std::string, std::weak_ptr<Folder>> folders;
+	std::vector<std::weak_ptr<File>> ids;
+
+	static std::string Key(std::filesystem::path path);
+	static std::string Join(const std::string& dir, const std::string& name) { return dir.empty() ? name : dir + "/" + name; }
 };
 
+class FileIterator;
+class FolderIterator;
+
 class Folder : public std::enable_shared_from_this<Folder> {
 	friend FileSystem;
+	friend FileIterator;
+	friend FolderIterator;
 	
 	std::weak_ptr<Folder> mParent;
 	std::weak_ptr<FileSystem> mFileSystem;
+	std::weak_ptr<PathIndex> mIndex;
 
 	uint16_t mID;
 	std::string mName;
 	std::vector<std::shared_ptr<File>> mFiles;
 	std::vector<std::shared_ptr<Folder>> mFolders;
 
+	void Index(std::shared_ptr<PathIndex> index, std::string path);
+	void ListTree(const std::filesystem::path& out_path, std::vector<std::filesystem::path>& dirs, std::vector<std::pair<std::filesystem::path, File*>>& files);
+
+	template<typename OnFolder, typename OnFile>
+	static void Walk(const std::shared_ptr<Folder>& dir, OnFolder& onFolder, OnFile& onFile){
+		onFolder(dir);
+		for(const auto& folder : dir->mFolders){
+			Walk(folder, onFolder, onFile);
+		}
+		for(const auto& file : dir->mFiles){
+			onFile(file);
+		}
+	}
+
 public:
 
 	void SetParent(std::shared_ptr<Folder> parent) { mParent = parent; }
 
 	void SetName(std::string n) { mName = n; }
-	std::string GetName() { return mName; }
+	const std::string& GetName() { return mName; }
+	std::string GetPath(); // relative to the root, empty for the root itself
 	std::shared_ptr<File> GetFile(std::filesystem::path);
 
 	std::shared_ptr<File> AddFile(std::shared_ptr<File> file);
 	
 	void AddFolder(std::shared_ptr<Folder> folder);
 
-	void Dump(std::filesystem::path out_path);
+	// Writes this folder's tree under out_path with up to threads writers, 0 for one per core.
+	// Built with PALKIA_IO_URING, files are written through io_uring with threads * 8 in flight.
+	bool Dump(std::filesystem::path out_path, uint32_t threads = 0);
 
 	static std::shared_ptr<Folder> Create(std::shared_ptr<FileSystem> fs) { return std::make_shared<Folder>(fs); }
 
@@ -95,6 +302,25 @@ public:
 	void ForEachFile(std::function<void(std::shared_ptr<File>)> OnFile);
 	void Traverse(std::function<void(std::shared_ptr<Folder>)> OnFolder, std::function<void(std::shared_ptr<File>)> OnFile);
 
+	// Same order as ForEachFile/Traverse, but inlined and without copying a shared_ptr per node
+	template<typename OnFile>
+	void VisitFiles(OnFile&& onFile){
+		for(const auto& folder : mFolders){
+			folder->VisitFiles(onFile);
+		}
+		for(const auto& file : mFiles){
+			onFile(file);
+		}
+	}
+
+	template<typename OnFolder, typename OnFile>
+	void Visit(OnFolder&& onFolder, OnFile&& onFile){
+		Walk(GetPtr(), onFolder, onFile);
+	}
+
+	// Every file below this folder, ForEachFile order
+	auto Files();
+
 	Folder(std::shared_ptr<FileSystem> fs){
 		mFileSystem = fs;
 	}
@@ -103,24 +329,184 @@ public:
 	~Folder(){}
 };
 
+// Walks a tree of files with an explicit stack, in ForEachFile order. Yields the tree's own
+// shared_ptrs by reference, so nothing is copied unless the caller keeps one.
+class FileIterator {
+	struct Frame {
+		Folder* folder; // null for a flat file list
+		const std::vector<std::shared_ptr<File>>* files;
+		std::size_t folderIdx;
+		std::size_t fileIdx;
+	};
+	std::vector<Frame> mStack;
+
+	void Settle(){
+		while(!mStack.empty()){
+			Frame& top = mStack.back();
+			if(top.folder != nullptr && top.folderIdx < top.folder->mFolders.size()){
+				Folder* child = top.folder->mFolders[top.folderIdx++].get();
+				mStack.push_back({ child, &child->mFiles, 0, 0 });
+				continue;
+			}
+			if(top.fileIdx < top.files->size()) return;
+			mStack.pop_back();
+		}
+	}
+
+public:
+	using value_type = std::shared_ptr<File>;
+	using difference_type = std::ptrdiff_t;
+
+	FileIterator() {}
+	FileIterator(Folder* root){
+		if(root != nullptr) mStack.push_back({ root, &root->mFiles, 0, 0 });
+		Settle();
+	}
+	FileIterator(const std::vector<std::shared_ptr<File>>* files){
+		mStack.push_back({ nullptr, files, 0, 0 });
+		Settle();
+	}
+
+	const std::shared_ptr<File>& operator*() const { return (*mStack.back().files)[mStack.back().fileIdx]; }
+	FileIterator& operator++(){ mStack.back().fileIdx++; Settle(); return *this; }
+	void operator++(int){ ++*this; }
+	bool operator==(std::default_sentinel_t) const { return mStack.empty(); }
+};
+
+// Pre-order over folders, parents before children, Traverse order
+class FolderIterator {
+	struct Frame {
+		const std::shared_ptr<Folder>* folder;
+		std::size_t folderIdx;
+	};
+	std::vector<Frame> mStack;
+
+public:
+	using value_type = std::shared_ptr<Folder>;
+	using difference_type = std::ptrdiff_t;
+
+	FolderIterator() {}
+	FolderIterator(const std::shared_ptr<Folder>* root){
+		if(root != nullptr && *root != nullptr) mStack.push_back({ root, 0 });
+	}
+
+	const std::shared_ptr<Folder>& operator*() const { return *mStack.back().folder; }
+	FolderIterator& operator++(){
+		while(!mStack.empty()){
+			Frame& top = mStack.back();
+			if(top.folderIdx < (*top.folder)->mFolders.size()){
+				mStack.push_back({ &(*top.folder)->mFolders[top.folderIdx++], 0 });
+				return *this;
+			}
+			mStack.pop_back();
+		}
+		return *this;
+	}
+	void operator++(int){ ++*this; }
+	bool operator==(std::default_sentinel_t) const { return mStack.empty(); }
+};
+
+template<typename Iterator>
+struct TreeRange : std::ranges::view_interface<TreeRange<Iterator>> {
+	Iterator first;
+	Iterator begin() const { return first; }
+	std::default_sentinel_t end() const { return {}; }
+};
+
+inline auto Folder::Files() { return TreeRange<FileIterator>{ {}, FileIterator(this) }; }
+
+// Where a file's payload sits in a file image, relative to the start of the image
+struct FileSlot {
+	uint32_t start;
+	uint32_t end;
+	bool duplicate; // points at an earlier file's copy, nothing to write
+};
+
+// FNT and FAT order produced by FileSystem::WriteTables
+struct FileTables {
+	std::vector<uint8_t> fnt;
+	std::vector<std::shared_ptr<File>> files; // by new file ID, which is also FAT order
+	uint16_t firstID { 0 }; // of files[0]
+	uint16_t folderCount { 0 };
+	bool renumber { true }; // false leaves the tree's own IDs alone, for tables that only go out to a copy
+};
+
 class FileSystem {
 	friend Rom;
 	friend Archive;
+	friend class Snapshot;
 private:
 	bool mHasFNT { true };
 	uint32_t mNextFileID { 0 };
 	std::shared_ptr<Folder> mRoot;
 	std::vector<std::shared_ptr<File>> mFiles; // only used when no FNT
+	std::shared_ptr<PathIndex> mIndex; // built with the tree, lazily for trees put together by hand
 	std::shared_ptr<Folder> ParseDirectory(bStream::CStream& strm, std::vector<std::shared_ptr<File>>& files, uint16_t id, std::string path, std::shared_ptr<Folder> parent);
 
-	void WriteDirectory(bStream::CStream& foldeStream, bStream::CStream& dataStream, std::shared_ptr<Folder> mDir);
+	void WriteDirectory(const std::shared_ptr<Folder>& dir, uint16_t parentID, std::size_t idField, FileTables& tables, std::vector<uint8_t>& subTables);
+
+	void ListTree(const std::filesystem::path& out_path, std::vector<std::filesystem::path>& dirs, std::vector<std::pair<std::filesystem::path, File*>>& files);
+	void Find(Folder& dir, const Glob& pattern, const std::vector<uint16_t>& states, std::string_view magic, std::vector<uint8_t>& head, std::vector<File*>& results);
+
+	// for owners whose FAT holds more than the tree does, like a rom's overlays
+	void SetIDTable(const std::vector<std::shared_ptr<File>>& files);
 
 public:
 	void Traverse(std::function<void(std::shared_ptr<Folder>)> OnFolder, std::function<void(std::shared_ptr<File>)> OnFile);
 	void ForEachFile(std::function<void(std::shared_ptr<File>)> OnFile);
 
+	// Inlined Traverse/ForEachFile, callbacks get the tree's own shared_ptrs by const reference
+	template<typename OnFolder, typename OnFile>
+	void Visit(OnFolder&& onFolder, OnFile&& onFile){
+		if(!mHasFNT){
+			for(const auto& file : mFiles) onFile(file);
+		} else if(mRoot != nullptr){
+			Folder::Walk(mRoot, onFolder, onFile);
+		}
+	}
+
+	template<typename OnFile>
+	void VisitFiles(OnFile&& onFile){
+		if(!mHasFNT){
+			for(const auto& file : mFiles) onFile(file);
+		} else if(mRoot != nullptr){
+			mRoot->VisitFiles(onFile);
+		}
+	}
+
+	// for(const auto& file : fs.Files()), same order as ForEachFile
+	auto Files() { return TreeRange<FileIterator>{ {}, mHasFNT ? FileIterator(mRoot.get()) : FileIterator(&mFiles) }; }
+	auto Folders() { return TreeRange<FolderIterator>{ {}, FolderIterator(mHasFNT ? &mRoot : nullptr) }; }
+
 	std::shared_ptr<File> GetFile(std::filesystem::path);
+	std::shared_ptr<Folder> GetFolder(std::filesystem::path);
+	std::shared_ptr<File> GetFileByID(uint32_t id);
+
+	// Appends every file matching pattern, and starting with magic if it's given, to results
+	// and returns the part that was added. Folders the pattern rules out aren't walked, and
+	// only the first bytes of lazily opened files are read. Handles are valid while the files
+	// stay in the tree, GetPtr() gives an owning one.
+	std::span<File* const> Find(const Glob& pattern, std::vector<File*>& results, std::string_view magic = {});
 	std::shared_ptr<Folder> GetRoot(){ return mRoot; }
+
+	// see Folder::Dump, also leaves a Manifest of the tree at the root for Import. Its IDs and
+	// paths cost nothing, fingerprints hash every file and so read back every payload the dump
+	// just copied out of the image.
+	bool Dump(std::filesystem::path out_path, uint32_t threads = 0, bool fingerprints = false);
+
+	// Path, ID, size and hash of every file, hashed with up to threads workers. Manifest::Compare
+	// on two of these tells what changed between two roms without comparing any payloads.
+	Manifest BuildManifest(uint32_t threads = 0);
+
+	// Replaces the tree with the directory at path, listed and read with up to threads workers.
+	// When a previous Dump left a manifest there, files keep their old IDs relative to each
+	// other and anything new is numbered after them. The tree is numbered from where the one
+	// it replaces started, or the manifest's lowest ID, and IDs below that, like a rom's
+	// overlays, are kept.
+	bool Import(std::filesystem::path path, uint32_t threads = 0);
+
+	// Index only follows AddFile/AddFolder, call this after renaming things
+	void Reindex();
 	
 	std::vector<std::pair<uint32_t, uint32_t>> ParseFAT(bStream::CStream& strm, uint32_t entryCount);
 	std::shared_ptr<Folder> ParseFNT(bStream::CStream& strm, uint32_t fntSize, std::vector<std::shared_ptr<File>>& files);
@@ -128,8 +514,17 @@ public:
 	uint32_t CalculateFNTSize();
 	uint32_t CalculateFATSize();
 
-	void WriteFNT(bStream::CStream& strm);
-	void WriteFAT(bStream::CStream& strm);
+	// Numbers every folder and file in pre-order and writes the FNT in one walk of the tree.
+	// tables.files comes out in ID order, ready to be laid out and written to a FAT. IDs below
+	// firstID are left to the caller. Without tables.renumber nothing in the tree is changed.
+	void WriteTables(FileTables& tables, uint16_t firstID = 0);
+
+	void WriteFNT(bStream::CStream& strm); // renumbers, same as WriteTables
+	void WriteFAT(bStream::CStream& strm); // renumbers too, files at 32 byte aligned offsets from 0
+
+	// Lays files out back to back in the given order, each start aligned. With deduplicate set,
+	// files with identical contents share the first copy's slot.
+	static std::vector<FileSlot> LayoutFiles(std::vector<std::shared_ptr<File>>& files, uint32_t alignment, bool deduplicate, uint32_t& imageSize);
 
 	FileSystem();
 	~FileSystem();
@@ -0,0 +1,94 @@
+#pragma once
+#include <span>
+#include <string>
+#include <vector>
+#include <ranges>
+#include <string_view>
+#include <filesystem>
+#include <bstream/bstream.h>
+
+namespace Palkia::Nitro {
+
+// Read-mostly alternative to FileSystem that stores the tree the way the FNT does. Folder n is
+// main table entry n (FNT ID 0xF000 | n), a folder's files are the run of IDs starting at its
+// first file ID, and everything is indices into a handful of flat tables. Names share one pool.
+// Standalone for now, Rom and Archive still build a FileSystem.
+class FlatFileSystem {
+public:
+	static constexpr uint16_t None = 0xFFFF;
+
+	struct Name {
+		uint32_t offset;
+		uint8_t length;
+	};
+
+private:
+	// folder tables, indexed by folder ID & 0xFFF
+	std::vector<uint16_t> mFolderParent; // None for the root
+	std::vector<uint16_t> mFolderFirstFile;
+	std::vector<uint16_t> mFolderFileCount;
+	std::vector<uint32_t> mFolderFirstChild; // into mChildren
+	std::vector<uint16_t> mFolderChildCount;
+	std::vector<Name> mFolderName;
+	std::vector<uint16_t> mChildren; // subfolder IDs, grouped by parent in FNT order
+	std::vector<uint16_t> mChildSlot; // how many of the parent's file entries come before each subfolder entry
+
+	// file tables, indexed by file ID. IDs below the root's first file (overlays) have no name
+	std::vector<uint16_t> mFileFolder;
+	std::vector<Name> mFileName;
+	std::vector<uint32_t> mFileStart;
+	std::vector<uint32_t> mFileEnd;
+
+	std::string mNames;
+
+	std::string_view GetName(Name name) const { return std::string_view(mNames).substr(name.offset, name.length); }
+	uint16_t FindChild(uint16_t folder, std::string_view name) const;
+
+public:
+	// Reads fntSize bytes of FNT from the current position. Fails on anything that isn't a
+	// tree, like a folder listed twice, nowhere or inside itself, or a file in two folders.
+	bool ParseFNT(bStream::CStream& strm, uint32_t fntSize);
+	void ParseFAT(bStream::CStream& strm, uint32_t entryCount);
+
+	// Sub-table entries keep the order they were read in, so an unchanged FNT writes back byte for byte
+	uint32_t CalculateFNTSize() const;
+	uint32_t CalculateFATSize() const { return mFileStart.size() * 8; }
+	void WriteFNT(bStream::CStream& strm) const;
+	void WriteFAT(bStream::CStream& strm) const;
+
+	uint16_t GetFolderCount() const { return mFolderParent.size(); }
+	uint16_t GetFileCount() const { return mFileFolder.size(); }
+
+	std::string_view GetFolderName(uint16_t folder) const { return GetName(mFolderName[folder]); }
+	uint16_t GetFolderParent(uint16_t folder) const { return mFolderParent[folder]; }
+	std::span<const uint16_t> GetSubfolders(uint16_t folder) const { return std::span(mChildren).subspan(mFolderFirstChild[folder], mFolderChildCount[folder]); }
+	auto GetFiles(uint16_t folder) const { return std::views::iota(mFolderFirstFile[folder], uint16_t(mFolderFirstFile[folder] + mFolderFileCount[folder])); }
+	std::string GetFolderPath(uint16_t folder) const; // relative to the root, empty for the root itself
+
+	std::string_view GetFileName(uint16_t file) const { return GetName(mFileName[file]); }
+	uint16_t GetFileFolder(uint16_t file) const { return mFileFolder[file]; }
+	uint32_t GetFileStart(uint16_t file) const { return mFileStart[file]; }
+	uint32_t GetFileEnd(uint16_t file) const { return mFileEnd[file]; }
+	uint32_t GetFileSize(uint16_t file) const { return mFileEnd[file] - mFileStart[file]; }
+	std::string GetFilePath(uint16_t file) const;
+
+	// None when there's nothing at path
+	uint16_t FindFile(std::filesystem::path path) const;
+	uint16_t FindFolder(std::filesystem::path path) const;
+
+	// Folders in ID order then each folder's files, which is how the tables are laid out
+	template<typename OnFolder, typename OnFile>
+	void Visit(OnFolder&& onFolder, OnFile&& onFile) const {
+		for(uint16_t folder = 0; folder < mFolderParent.size(); folder++){
+			onFolder(folder);
+			for(uint16_t file : GetFiles(folder)){
+				onFile(file);
+			}
+		}
+	}
+
+	FlatFileSystem() {}
+	~FlatFileSystem() {}
+};
+
+}
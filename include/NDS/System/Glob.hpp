@@ -0,0 +1,51 @@
+#pragma once
+#include <bitset>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+
+namespace Palkia::Nitro {
+
+// Path pattern compiled once and matched a component at a time, so a tree walk can drop a
+// folder as soon as no part of the pattern can match it.
+//   *      any run of characters within one name
+//   ?      any single character
+//   [a-z]  a character class, [!a-z] negated
+//   **     any number of folders, including none
+// Patterns are relative to the root, a leading '/' is ignored. A pattern without any '/'
+// matches file names at every depth, so "*.narc" is the same as "**/*.narc".
+class Glob {
+	struct Token {
+		enum class Kind : uint8_t { Literal, Star, One, Class } kind;
+		std::string literal;
+		std::bitset<256> set;
+	};
+
+	struct Component {
+		bool globstar { false };
+		bool literal { true }; // just text, compared directly
+		std::string text;
+		std::vector<Token> tokens;
+	};
+
+	std::vector<Component> mComponents;
+
+	bool MatchComponent(const Component& component, std::string_view name) const;
+	void Close(std::vector<uint16_t>& states) const;
+
+public:
+	// States are indices of the components the next name could match. Start() is the state at
+	// the root, Enter() steps into a folder, and empty means nothing below it can match.
+	std::vector<uint16_t> Start() const;
+	void Enter(const std::vector<uint16_t>& states, std::string_view folder, std::vector<uint16_t>& next) const;
+	bool MatchFile(const std::vector<uint16_t>& states, std::string_view name) const;
+
+	// Whole "/" separated path, for callers that already have one
+	bool Match(std::string_view path) const;
+
+	Glob(std::string_view pattern);
+	~Glob() {}
+};
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <memory>
+#include <filesystem>
+#include <cstdint>
+#include <mutex>
+#include <fstream>
+
+namespace Palkia::Nitro {
+
+// A ROM image held open for the lifetime of the files that point into it.
+// Mapped privately, so writes through a view never reach the file on disk.
+// An opened (unmapped) image only keeps the descriptor and reads on request, a mapped
+// one keeps it too so payloads can be copied between files without touching the mapping.
+class Image {
+	uint8_t* mData { nullptr };
+	std::size_t mSize { 0 };
+	bool mMapped { false };
+	int mFd { -1 };
+
+public:
+	uint8_t* GetData() { return mData; }
+	std::size_t GetSize() { return mSize; }
+	bool IsMapped() { return mMapped; }
+	int GetFd() { return mFd; } // -1 when no descriptor is kept, like on Windows
+
+	// Positional read, doesn't move any shared cursor
+	bool Read(std::size_t offset, uint8_t* dst, std::size_t size);
+
+	// Whether the file at path is the one this image still reads from or maps, which
+	// anything writing to path has to leave alone
+	bool IsFile(std::filesystem::path path);
+
+	static std::shared_ptr<Image> Map(std::filesystem::path path);
+	static std::shared_ptr<Image> Open(std::filesystem::path path);
+
+	Image() {}
+	~Image();
+};
+
+// Output file preallocated to its final size, safe to write from several threads at once
+class ImageWriter {
+	int mFd { -1 };
+	std::fstream mStream; // fallback when there's no pwrite
+	std::mutex mLock;
+
+public:
+	bool Open(std::filesystem::path path, std::size_t size);
+	bool Open(std::filesystem::path path); // existing file, nothing is truncated
+	bool Write(std::size_t offset, const uint8_t* data, std::size_t size);
+	bool Fill(std::size_t offset, std::size_t size, uint8_t value);
+
+	ImageWriter() {}
+	~ImageWriter();
+};
+
+}
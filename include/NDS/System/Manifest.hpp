@@ -0,0 +1,64 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+#include <unordered_map>
+
+namespace Palkia::Nitro {
+
+// Fingerprint of a file tree, written at the root of a dump so FileSystem::Import can put
+// files back in their original FAT order, and so two trees can be compared by hash alone.
+// One "id<TAB>size<TAB>hash<TAB>path" line per file, paths relative and "/" separated, or
+// just "id<TAB>path" for a manifest without fingerprints.
+class Manifest {
+public:
+	struct Entry {
+		uint32_t id;
+		uint32_t size;
+		uint64_t hash; // File::GetHash
+		std::string path;
+	};
+
+	// Paths only in one manifest, or in both with different contents
+	struct Diff {
+		std::vector<std::string> added;
+		std::vector<std::string> removed;
+		std::vector<std::string> changed;
+
+		bool Empty() const { return added.empty() && removed.empty() && changed.empty(); }
+	};
+
+	static constexpr std::string_view FileName = ".palkia_manifest";
+
+private:
+	std::vector<Entry> mEntries;
+	std::unordered_map<std::string, std::size_t> mByPath;
+	bool mFingerprints { true }; // sizes and hashes are there
+
+	void Reindex();
+
+public:
+	std::vector<Entry>& GetEntries() { return mEntries; }
+	void Add(Entry entry);
+	const Entry* Find(const std::string& path) const;
+
+	// Without fingerprints only IDs and paths are kept and saved
+	bool HasFingerprints() const { return mFingerprints; }
+	void SetFingerprints(bool fingerprints) { mFingerprints = fingerprints; }
+
+	// Whether a file at path still has the contents recorded here, never without fingerprints
+	bool Unchanged(const std::string& path, uint32_t size, uint64_t hash) const;
+
+	// Paths in both count as changed unless both manifests have fingerprints
+	static Diff Compare(const Manifest& before, const Manifest& after);
+
+	bool Save(std::filesystem::path path);
+	bool Load(std::filesystem::path path); // also reads the older id/path only format
+
+	Manifest() {}
+	~Manifest() {}
+};
+
+}
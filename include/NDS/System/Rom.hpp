@@ -3,8 +3,10 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <optional>
 #include <bstream/bstream.h>
 #include "NDS/System/FileSystem.hpp"
+#include "NDS/System/Snapshot.hpp"
 #include <filesystem>
 #include "Util.hpp"
 
@@ -85,6 +87,12 @@ typedef struct NitroBanner {
 } Banner;
 #pragma pack(pop)
 
+enum class LoadMode {
+	Copy, // every FAT entry is read into its own buffer up front
+	Map,  // files are views into a private mapping of the image, copied only once modified
+	Lazy  // only the FAT and FNT are read, each file is read the first time its data is asked for
+};
+
 struct Overlay {
 	uint32_t overlayID;
 	uint32_t ramAddress;
@@ -98,40 +106,135 @@ struct Overlay {
 	std::weak_ptr<File> file;
 };
 
+struct RomChecksums {
+	bool header { false };
+	bool logo { false };
+	bool banner { false };
+	bool secureArea { false };
+	bool secureAreaChecked { false }; // a decrypted secure area's crc is over the encrypted data, so it can't be checked
+
+	bool Ok() { return header && logo && banner && (secureArea || !secureAreaChecked); }
+};
+
+// One contiguous piece of the output image. Exactly one of file/data is set,
+// or neither for a run of padding bytes.
+struct RomSegment {
+	uint32_t offset;
+	uint32_t size;
+	std::shared_ptr<File> file { nullptr };
+	uint8_t* data { nullptr };
+	uint8_t fill { 0xFF };
+};
+
+// Where everything goes in a saved image, worked out from sizes alone
+struct RomLayout {
+	RomHeader header;
+	std::vector<uint8_t> banner;
+	std::vector<uint8_t> fnt;
+	std::vector<uint8_t> fat;
+	std::vector<uint8_t> overlayTable9;
+	std::vector<uint8_t> overlayTable7;
+	std::vector<Overlay> overlays9; // with the FAT IDs this layout gives them
+	std::vector<Overlay> overlays7;
+	std::vector<RomSegment> segments;
+	std::vector<std::shared_ptr<File>> files; // in FAT order
+	uint16_t firstTreeID { 0 }; // the overlays come before it
+	uint32_t size { 0 };
+};
+
 class Rom {
 	private:
-		RomHeader mHeader;
+		RomHeader mHeader; // as it is on disk at mPath, saving elsewhere lays out its own
 		Banner mBanner;
+		std::vector<uint8_t> mBannerExtra; // newer banner versions carry more titles and the dsi icon past the v1 banner
 		FileSystem mFS;
 
 		std::vector<Overlay> mOverlays7;
 		std::vector<Overlay> mOverlays9;
 
 		bool mHasSig { false };
+		bool mDeduplicate { false };
 		bool mArm9Compressed { false };
 		std::array<uint8_t, 0x88> mRsaSig;
-		std::array<uint32_t, 3> mNitroFooter; // no idea what this is supposed to be
+		std::array<uint32_t, 3> mNitroFooter {}; // no idea what this is supposed to be
 
 		// this contains things like arm9 as  files
 		std::shared_ptr<Folder> mRomFiles = nullptr;
 
+		// only set when opened with LoadMode::Map or LoadMode::Lazy
+		std::shared_ptr<Image> mImage = nullptr;
+
+		// the FAT as it currently is on disk at mPath, what Patch works against
+		std::filesystem::path mPath;
+		std::vector<std::pair<uint32_t, uint32_t>> mFAT;
+		std::vector<std::weak_ptr<File>> mFATFiles;
+
+		// swapped whole, a reader never sees half of one
+		std::atomic<std::shared_ptr<const Snapshot>> mSnapshot;
+
+		std::shared_ptr<File> ReadFile(bStream::CStream& romFile, uint32_t id, uint32_t start, uint32_t end);
+
+		// fills in place, segments point back into the layout itself. Nothing in the Rom changes,
+		// OnDisk gives it the layout's IDs and crcs once it's written over the image.
+		void Layout(RomLayout& layout);
+		bool WriteLayout(RomLayout& layout, std::filesystem::path p, uint32_t threads);
+		bool WriteLayout(RomLayout& layout, bStream::CStream& stream);
+		bool RebuildInPlace();
+		void OnDisk(RomLayout& layout); // layout was just written to mPath
+
+		// whether writing to p would pull the ground out from under files still reading from it
+		bool ReadsFrom(std::filesystem::path p);
+
+		std::vector<uint8_t> BannerData();
+		std::array<uint16_t, 4> BannerChecksums(std::vector<uint8_t>& banner);
+		bool SecureArea(RomHeader& header, std::array<uint8_t, 0x4000>& area);
+		void UpdateChecksums(RomHeader& header);
+
 	public:
 		RomHeader GetHeader();
 		Banner GetBanner();
 
 		std::shared_ptr<File> GetFile(std::filesystem::path);
+		std::shared_ptr<File> GetFileByID(uint32_t id) { return mFS.GetFileByID(id); } // overlays included
 		std::vector<Overlay>& GetOverlays7() { return mOverlays7; }
 		std::vector<Overlay>& GetOverlays9() { return mOverlays9; }
 
-		FileSystem GetFS() { return mFS; }
+		FileSystem& GetFS() { return mFS; }
+
+		// The last published Snapshot of GetFS(), taken on first use. Safe from any thread,
+		// readers keep theirs alive for as long as they need it.
+		std::shared_ptr<const Snapshot> GetSnapshot();
 
-		void Dump();
+		// Freezes GetFS() as it is now and hands it to later GetSnapshot calls. Changes go through
+		// GetFS() from one thread, which publishes once they're done.
+		std::shared_ptr<const Snapshot> Publish();
 
-		Rom(std::filesystem::path);
-		void Save(std::filesystem::path);
-		bStream::CMemoryStream Save();
+		void Dump(uint32_t threads = 0);
+
+		Rom(std::filesystem::path, LoadMode mode = LoadMode::Copy);
+		// Identical files share one copy in saved images
+		void SetDeduplicate(bool deduplicate) { mDeduplicate = deduplicate; }
+
+		// threads = 0 uses one writer per hardware thread. Saving over the image this Rom or any
+		// of its files still read from writes a new file next to it and renames it over.
+		bool Save(std::filesystem::path, uint32_t threads = 0);
+
+		// Emits the image front to back without ever seeking, so stream can be a pipe. Saving
+		// anywhere but over the image leaves this Rom's IDs and crcs as they are on disk.
+		bool Save(bStream::CStream& stream);
+		std::optional<bStream::CMemoryStream> Save(); // empty if a payload couldn't be read
+
+		// Writes dirty files back into the image this Rom was opened from. Files that still fit
+		// their slot are overwritten, ones that grew are appended, and only their FAT entries,
+		// the overlay tables and the header are touched. If files were added or removed the
+		// whole image is rebuilt instead. Renames aren't tracked, use Save for those. False if
+		// anything couldn't be written, the files stay dirty and the Rom keeps its old header.
+		bool Patch();
 		void GetRawIcon(Color out[32][32]);
 
+		// Checks the header, logo, secure area and banner crcs against what's loaded
+		RomChecksums Verify();
+
 		~Rom();
 };
 
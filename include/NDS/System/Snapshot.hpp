@@ -0,0 +1,37 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <filesystem>
+#include <unordered_map>
+#include "NDS/System/FileSystem.hpp"
+
+namespace Palkia::Nitro {
+
+// Read-only copy of a FileSystem as it was when taken, for handing out to worker threads.
+// Nothing in it changes after Take, so any number of threads can look files up and read
+// them without locking. Files share their payloads with the live tree copy on write: a live
+// file copies its payload before GetData hands it out for editing or it's marked dirty.
+// Files read lazily from an unmapped image are read again by the snapshot for itself, and
+// readers that go through File::Lease let a PayloadCache budget bound what that keeps around.
+class Snapshot {
+	std::vector<std::pair<std::string, std::shared_ptr<const File>>> mFiles; // ForEachFile order
+	std::unordered_map<std::string, std::size_t> mByPath;
+	std::vector<std::shared_ptr<const File>> mByID;
+
+public:
+	std::shared_ptr<const File> GetFile(std::filesystem::path path) const;
+	std::shared_ptr<const File> GetFileByID(uint32_t id) const { return id < mByID.size() ? mByID[id] : nullptr; }
+
+	// Paths are relative to the root and "/" separated
+	const std::vector<std::pair<std::string, std::shared_ptr<const File>>>& Files() const { return mFiles; }
+
+	// Only reads fs, but nothing may be changing it meanwhile
+	static std::shared_ptr<const Snapshot> Take(FileSystem& fs);
+
+	Snapshot() {}
+	~Snapshot() {}
+};
+
+}
@@ -31,6 +31,26 @@ uint8_t s3tcBlend(uint8_t a, uint8_t b);
 uint32_t PadTo32(uint32_t x);
 uint32_t Pad(uint32_t x, uint32_t y);
 
+// CRC-16/MODBUS as used by the rom header and banner, pass the previous result to continue a run
+uint16_t Crc16(const uint8_t* data, std::size_t size, uint16_t crc = 0xFFFF);
+
+// XXH64, fast non-cryptographic content hash. Hasher64 is the same thing fed in pieces.
+uint64_t Hash64(const uint8_t* data, std::size_t size, uint64_t seed = 0);
+
+class Hasher64 {
+    uint64_t mSeed;
+    uint64_t mLanes[4];
+    uint64_t mTotal { 0 };
+    uint8_t mBuffer[32];
+    std::size_t mBuffered { 0 };
+
+public:
+    void Update(const uint8_t* data, std::size_t size);
+    uint64_t Digest();
+
+    Hasher64(uint64_t seed = 0);
+};
+
 namespace Nitro {
 
 template <typename T>
@@ -4,75 +4,43 @@
 
 namespace Palkia::Nitro {
 
-void Archive::Dump(){
-    if(mFS.mHasFNT){
-        mFS.GetRoot()->Dump(".");
-    } else {
-        std::filesystem::create_directory("archive");
-        for (auto& file : mFS.mFiles){
-            bStream::CFileStream out(std::filesystem::path("archive") / file->GetName(), bStream::OpenMode::Out);
-            out.writeBytes(file->GetData(), file->GetSize());
-        }
-    }
+bool Archive::Dump(std::filesystem::path out_path, uint32_t threads){
+    return mFS.Dump(out_path, threads);
 }
 
 std::shared_ptr<File> Archive::GetFileByIndex(size_t index){
-
-    if(!mFS.mHasFNT){
-        return mFS.mFiles[index];
-    } else {
-        std::shared_ptr<File> r = nullptr;
-        mFS.ForEachFile([&](std::shared_ptr<File> f){
-            if(f->GetID() == index){
-                return;
-            }
-        });
-        return r;
-    }
-
+    return mFS.GetFileByID(index);
 }
 
 void Archive::SaveArchive(bStream::CStream& stream){
-    uint32_t fntSize = mFS.CalculateFNTSize();
-    uint32_t fatSize = mFS.CalculateFATSize();
-    uint32_t imgSize = 0;
+    FileTables tables;
+    mFS.WriteTables(tables);
+    std::vector<std::shared_ptr<File>>& files = tables.files;
 
-    mFS.ForEachFile([&](std::shared_ptr<File> f) { imgSize += PadTo32(f->GetSize()); });
+    uint32_t fntSize = PadTo32(tables.fnt.size());
+    uint32_t fatSize = PadTo32(files.size() * 8);
+    tables.fnt.resize(fntSize, 0);
 
-    fntSize = PadTo32(fntSize);
-    fatSize = PadTo32(fatSize);
+    std::vector<uint8_t> fatData(fatSize, 0);
+    bStream::CMemoryStream fatStream(fatData.data(), fatSize, bStream::Endianess::Little, bStream::OpenMode::Out);
+
+    uint32_t imgSize = 0;
+    std::vector<FileSlot> slots = FileSystem::LayoutFiles(files, 32, mDeduplicate, imgSize);
     imgSize = PadTo32(imgSize);
 
     uint32_t archiveSize = 0x10 + 0x18 + fntSize + fatSize + imgSize;
 
-    uint8_t* fntData = new uint8_t[fntSize];
-    uint8_t* fatData = new uint8_t[fatSize];
     uint8_t* imgData = new uint8_t[imgSize];
-
-    memset(fntData, 0, fntSize);
-    memset(fatData, 0, fatSize);
     memset(imgData, 0, imgSize);
 
-    bStream::CMemoryStream fntStream(fntData, fntSize, bStream::Endianess::Little, bStream::OpenMode::Out);
-    bStream::CMemoryStream fatStream(fatData, fatSize, bStream::Endianess::Little, bStream::OpenMode::Out);
-    bStream::CMemoryStream imgStream(imgData, imgSize, bStream::Endianess::Little, bStream::OpenMode::Out);
-
-    // calling write FNT will reset all IDs! it MUST be called FIRST
-    mFS.WriteFNT(fntStream);
-    mFS.WriteFAT(fatStream);
-
-	std::vector<std::shared_ptr<File>> files = {};
-
-	mFS.ForEachFile([&](std::shared_ptr<File> f){
-		files.push_back(f);
-	});
-	
-	std::sort(files.begin(), files.end(), [](std::shared_ptr<File> a, std::shared_ptr<File> b){ return a->GetID() < b->GetID(); });
-    
     for(std::size_t i = 0; i < files.size(); i++){
-        imgStream.writeBytes(files[i]->GetData(), files[i]->GetSize());
-        uint32_t paddedSize = PadTo32(imgStream.tell()); 
-        while(imgStream.tell() < paddedSize) imgStream.writeUInt8(0);
+        fatStream.writeUInt32(slots[i].start);
+        fatStream.writeUInt32(slots[i].end);
+
+        // read straight into place, lazily opened members don't stay loaded for it
+        if(!slots[i].duplicate && !files[i]->ReadBytes(0, imgData + slots[i].start, files[i]->GetSize())){
+            std::cout << "[Palkia] Couldn't read " << files[i]->GetName() << std::endl;
+        }
     }
 
     // Write NARC header
@@ -86,24 +54,22 @@ void Archive::SaveArchive(bStream::CStream& stream){
     stream.writeUInt32(0x46415442);
     stream.writeUInt32(fatSize + 0x0C);
     stream.writeUInt32(files.size());
-    stream.writeBytes(fatData, fatSize);
+    stream.writeBytes(fatData.data(), fatSize);
 
     // Write FNT header
     stream.writeUInt32(0x464E5442);
     stream.writeUInt32(fntSize + 0x08);
-    stream.writeBytes(fntData, fntSize);
+    stream.writeBytes(tables.fnt.data(), fntSize);
 
     // Write GMIF header
     stream.writeUInt32(0x46494D47);
     stream.writeUInt32(imgSize);
     stream.writeBytes(imgData, imgSize);
 
-    delete[] fntData;
-    delete[] fatData;
     delete[] imgData;
 }
 
-Archive::Archive(bStream::CStream& stream){
+void Archive::Parse(bStream::CStream& stream, std::function<std::shared_ptr<File>(uint32_t id, uint32_t start, uint32_t end)> member){
 	stream.seek(0x10);
     stream.readUInt32(); // BTAF
     uint32_t fatSize = stream.readUInt32(); // section size 0x00
@@ -125,7 +91,7 @@ Archive::Archive(bStream::CStream& stream){
 	std::vector<std::shared_ptr<File>> files;
     int id = 0;
 	for(auto file : mFS.ParseFAT(stream, fileCount)){
-		files.push_back(File::Load(stream, id++, file.first + imgOffset, file.second + imgOffset));
+		files.push_back(member(id++, file.first + imgOffset, file.second + imgOffset));
 	}
 
     stream.seek(fntOffset);
@@ -139,6 +105,22 @@ Archive::Archive(bStream::CStream& stream){
 }
 
 
+Archive::Archive(bStream::CStream& stream){
+    Parse(stream, [&](uint32_t id, uint32_t start, uint32_t end){ return File::Load(stream, id, start, end); });
+}
+
+Archive::Archive(std::shared_ptr<File> file){
+    // only held while parsing, members of a lazily opened archive are read on their own
+    std::shared_ptr<const uint8_t> data = file->Lease();
+    if(data == nullptr && file->GetSize() != 0){
+        std::cout << "[Palkia] Couldn't read " << file->GetName() << std::endl;
+        return;
+    }
+
+    bStream::CMemoryStream stream(const_cast<uint8_t*>(data.get()), file->GetSize(), bStream::Endianess::Little, bStream::OpenMode::In);
+    Parse(stream, [&](uint32_t id, uint32_t start, uint32_t end){ return File::Slice(file, id, start, end); });
+}
+
 Archive::~Archive(){}
 
 }
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include "NDS/System/Cache.hpp"
+#include "NDS/System/FileSystem.hpp"
+
+namespace Palkia::Nitro {
+
+std::mutex PayloadCache::sLock;
+std::list<File*> PayloadCache::sRecent;
+std::atomic<std::size_t> PayloadCache::sBudget = 0;
+std::size_t PayloadCache::sBytes = 0;
+std::size_t PayloadCache::sPeakBytes = 0;
+std::atomic<uint64_t> PayloadCache::sHits = 0;
+uint64_t PayloadCache::sMisses = 0;
+uint64_t PayloadCache::sEvictions = 0;
+
+void PayloadCache::Loaded(File* file){
+	std::lock_guard<std::mutex> lock(sLock);
+
+	sRecent.push_front(file);
+	file->mCacheEntry = sRecent.begin();
+	file->mCached = true;
+
+	sMisses++;
+	sBytes += file->mSize;
+	sPeakBytes = std::max(sPeakBytes, sBytes); // the new payload is in before anything makes room
+	Evict(file);
+}
+
+void PayloadCache::Touch(File* file){
+	sHits.fetch_add(1, std::memory_order_relaxed);
+
+	// order only matters once something can be evicted
+	if(sBudget == 0){
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(sLock);
+	if(file->mCached){
+		sRecent.splice(sRecent.begin(), sRecent, file->mCacheEntry);
+	}
+}
+
+void PayloadCache::Forget(File* file){
+	std::lock_guard<std::mutex> lock(sLock);
+	if(file->mCached){
+		sRecent.erase(file->mCacheEntry);
+		file->mCached = false;
+		sBytes -= file->mSize;
+	}
+}
+
+void PayloadCache::Evict(File* keep){
+	if(sBudget == 0){
+		return;
+	}
+
+	for(auto entry = sRecent.end(); sBytes > sBudget && entry != sRecent.begin();){
+		File* file = *--entry;
+
+		// files busy loading or being leased are skipped rather than waited on, lock order is
+		// file then cache everywhere else
+		if(file == keep || !file->mLoadLock.try_lock()){
+			continue;
+		}
+
+		// leases already handed out keep their own reference
+		file->mLeased = nullptr;
+		file->mCached = false;
+		file->mLoadLock.unlock();
+
+		sBytes -= file->mSize;
+		sEvictions++;
+		entry = sRecent.erase(entry);
+	}
+}
+
+void PayloadCache::SetBudget(std::size_t bytes){
+	std::lock_guard<std::mutex> lock(sLock);
+	sBudget = bytes;
+	Evict(nullptr);
+}
+
+PayloadCache::Stats PayloadCache::GetStats(){
+	std::lock_guard<std::mutex> lock(sLock);
+	return { sHits.load(std::memory_order_relaxed), sMisses, sEvictions, sBytes, sPeakBytes, sBudget.load() };
+}
+
+void PayloadCache::ResetStats(){
+	std::lock_guard<std::mutex> lock(sLock);
+	sHits = 0;
+	sMisses = 0;
+	sEvictions = 0;
+	sPeakBytes = sBytes;
+}
+
+}
@@ -1,107 +1,1039 @@
 #include <NDS/System/Compression.hpp>
+#include <queue>
+#include <tuple>
+#include <thread>
+#include <algorithm>
 
 namespace Palkia::Nitro::Compression {
 
+namespace {
+    constexpr uint32_t MinMatch = 3;
+
+    // Match limits and sizes of one LZ flavour
+    struct LZFormat {
+        uint32_t minDisp;
+        uint32_t maxDisp;
+        uint32_t maxLength;
+        uint32_t (*matchBytes)(uint32_t length);
+    };
+
+    constexpr LZFormat BLZFormat { 3, 0x1002, 18, [](uint32_t){ return 2u; } };
+    constexpr LZFormat LZ10Format { 2, 0x1000, 18, [](uint32_t){ return 2u; } };
+    constexpr LZFormat LZ11Format { 2, 0x1000, 0x10110, [](uint32_t length){ return length <= 0x10 ? 2u : length <= 0x110 ? 3u : 4u; } };
+
+    struct LZToken {
+        uint32_t length; // 0 for a literal
+        uint16_t disp;
+    };
+
+    struct LZMatch {
+        uint32_t length { 0 };
+        uint32_t disp { 0 };
+    };
+
+    // Hash chains over 3 byte sequences, newest position first. Links are only kept for a
+    // window's worth of positions, anything older is out of reach anyway.
+    class LZMatcher {
+        static constexpr uint32_t HashBits = 15;
+        static constexpr uint32_t WindowMask = 0x1FFF;
+
+        const std::vector<uint8_t>& mData;
+        const LZFormat& mFormat;
+        std::vector<int32_t> mHead;
+        std::vector<int32_t> mPrev;
+        uint32_t mChainLimit;
+        uint32_t mInserted;
+
+        uint32_t Hash(uint32_t pos) const {
+            uint32_t v = mData[pos] | (mData[pos + 1] << 8) | (mData[pos + 2] << 16);
+            return (v * 2654435761u) >> (32 - HashBits);
+        }
+
+    public:
+        // every position up to pos becomes a candidate
+        void InsertUpTo(uint32_t pos){
+            for(; mInserted < pos && mInserted + 2 < mData.size(); mInserted++){
+                uint32_t h = Hash(mInserted);
+                mPrev[mInserted & WindowMask] = mHead[h];
+                mHead[h] = mInserted;
+            }
+        }
+
+        // seed is a match already known to be at pos, only longer ones replace it. chainLimit
+        // overrides the matcher's own when it's set.
+        LZMatch Find(uint32_t pos, LZMatch seed = {}, uint32_t chainLimit = 0){
+            LZMatch best = seed;
+            if(pos + MinMatch > mData.size()){
+                return {};
+            }
+
+            InsertUpTo(pos);
+            uint32_t maxLength = std::min<uint32_t>(mFormat.maxLength, mData.size() - pos);
+            if(best.length >= maxLength){
+                return best;
+            }
+            uint32_t chain = chainLimit != 0 ? chainLimit : mChainLimit;
+
+            for(int32_t candidate = mHead[Hash(pos)]; candidate >= 0 && chain > 0; candidate = mPrev[candidate & WindowMask]){
+                uint32_t disp = pos - candidate;
+                if(disp > mFormat.maxDisp){
+                    break;
+                }
+                if(disp < mFormat.minDisp){
+                    continue;
+                }
+                chain--;
+
+                // can't beat the best so far unless it matches one byte further
+                if(mData[candidate + best.length] != mData[pos + best.length]){
+                    continue;
+                }
+
+                // the seed's own distance is known to match that far already
+                uint32_t length = disp == seed.disp ? seed.length : 0;
+                while(length < maxLength && mData[candidate + length] == mData[pos + length]){
+                    length++;
+                }
+
+                if(length > best.length){
+                    best = { length, disp };
+                    if(length == maxLength){
+                        break;
+                    }
+                }
+            }
+
+            if(best.length < MinMatch){
+                best = {};
+            }
+            return best;
+        }
+
+        // start is the first position that will be searched from, the window before it gets indexed
+        LZMatcher(const std::vector<uint8_t>& data, const LZFormat& format, uint32_t chainLimit, uint32_t start = 0) : mData(data), mFormat(format), mHead(1 << HashBits, -1), mPrev(WindowMask + 1, -1), mChainLimit(chainLimit) {
+            mInserted = start > format.maxDisp ? start - format.maxDisp : 0;
+        }
+    };
+
+    // Minimum cost parse over every match length at every position. Costs are in bits, a flag
+    // bit plus the token's bytes, which is exact up to the last flag byte. Longest matches are
+    // found in parallel blocks since each only looks back one window.
+    std::vector<LZToken> OptimalParse(const std::vector<uint8_t>& data, const LZFormat& format, uint32_t threads){
+        uint32_t size = data.size();
+        std::vector<uint32_t> longest(size, 0);
+        std::vector<uint16_t> disps(size, 0);
+
+        if(threads == 0){
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        uint32_t blockSize = std::max<uint32_t>(0x10000, (size + threads - 1) / threads);
+
+        auto findMatches = [&](uint32_t start){
+            uint32_t end = std::min(size, start + blockSize);
+            LZMatcher matcher(data, format, format.maxDisp, start);
+            for(uint32_t pos = start; pos < end; pos++){
+                // One byte into a match the same distance still matches all but that byte, so
+                // the search starts from that and only has to find something longer. Past 0x110
+                // every length costs the same, a short chain is enough to find a longer match
+                // at another distance, and extending the carried one doesn't compare it again.
+                LZMatch carried;
+                if(pos > start && longest[pos - 1] > MinMatch){
+                    carried = { longest[pos - 1] - 1, disps[pos - 1] };
+                }
+
+                LZMatch match = matcher.Find(pos, carried, carried.length > 0x110 ? 64 : 0);
+                longest[pos] = match.length;
+                disps[pos] = match.disp;
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for(uint32_t start = blockSize; start < size; start += blockSize){
+            workers.emplace_back(findMatches, start);
+        }
+        findMatches(0);
+        for(auto& worker : workers){
+            worker.join();
+        }
+
+        std::vector<uint32_t> cost(size + 1, UINT32_MAX);
+        std::vector<uint32_t> step(size + 1, 0); // token length that reached each position, 1 for a literal
+        cost[0] = 0;
+        for(uint32_t pos = 0; pos < size; pos++){
+            if(cost[pos] + 9 < cost[pos + 1]){
+                cost[pos + 1] = cost[pos] + 9;
+                step[pos + 1] = 1;
+            }
+
+            // A shorter piece of the longest match sometimes leaves a better next step. Past 0x110
+            // every length costs the same, so only the longest is worth trying there.
+            for(uint32_t length = longest[pos]; length >= MinMatch; length = length > 0x110 ? 0x110 : length - 1){
+                uint32_t bits = cost[pos] + 1 + 8 * format.matchBytes(length);
+                if(bits < cost[pos + length]){
+                    cost[pos + length] = bits;
+                    step[pos + length] = length;
+                }
+            }
+        }
+
+        std::vector<LZToken> tokens;
+        for(uint32_t pos = size; pos > 0; pos -= step[pos]){
+            uint32_t from = pos - step[pos];
+            tokens.push_back(step[pos] == 1 ? LZToken { 0, 0 } : LZToken { step[pos], disps[from] });
+        }
+        std::reverse(tokens.begin(), tokens.end());
+
+        return tokens;
+    }
+
+    // Greedy or lazy parse
+    std::vector<LZToken> Parse(const std::vector<uint8_t>& data, const LZFormat& format, Level level, uint32_t threads){
+        if(level == Level::Optimal){
+            return OptimalParse(data, format, threads);
+        }
+
+        uint32_t chainLimit = level == Level::Fast ? 8 : level == Level::Normal ? 64 : format.maxDisp;
+        LZMatcher matcher(data, format, chainLimit);
+
+        std::vector<LZToken> tokens;
+        tokens.reserve(data.size() / 2);
+
+        uint32_t pos = 0;
+        LZMatch match = matcher.Find(pos);
+        while(pos < data.size()){
+            LZMatch next;
+            if(match.length != 0 && level != Level::Fast && match.length < format.maxLength){
+                next = matcher.Find(pos + 1);
+                if(next.length > match.length){
+                    tokens.push_back({ 0, 0 });
+                    pos++;
+                    match = next;
+                    continue;
+                }
+            }
+
+            if(match.length == 0){
+                tokens.push_back({ 0, 0 });
+                pos++;
+            } else {
+                tokens.push_back({ match.length, static_cast<uint16_t>(match.disp) });
+                pos += match.length;
+            }
+            match = matcher.Find(pos);
+        }
+
+        return tokens;
+    }
+
+    // Match copy 8 bytes at a time. Short displacements are widened to a multiple of themselves
+    // that's at least 8, the output repeats with that period too. Writes up to 7 bytes past the
+    // end of the match, so the output needs that much slack.
+    inline void CopyMatch(uint8_t* dst, uint32_t disp, uint32_t length){
+        uint32_t i = 0;
+        if(disp < 8){
+            uint32_t widened = disp * ((7 + disp) / disp);
+            for(const uint8_t* src = dst - disp; i < length && i < widened - disp; i++){
+                dst[i] = src[i];
+            }
+            disp = widened;
+        }
+
+        for(const uint8_t* src = dst - disp; i < length; i += 8){
+            uint64_t chunk;
+            memcpy(&chunk, src + i, 8);
+            memcpy(dst + i, &chunk, 8);
+        }
+    }
+
+    // Type byte and 24 bit decompressed size that every BIOS format starts with. Sizes past
+    // 24 bits, and 0, are written as 0 with the real one in the next word. Fails for a lazy
+    // file that couldn't be read.
+    bool ReadHeader(const uint8_t* in, uint32_t inSize, uint8_t type, uint32_t& size, uint32_t& read){
+        if(in == nullptr || inSize < 4 || in[0] != type){
+            return false;
+        }
+
+        size = in[1] | (in[2] << 8) | (in[3] << 16);
+        read = 4;
+        if(size == 0){
+            if(inSize < 8){
+                return false;
+            }
+            size = in[4] | (in[5] << 8) | (in[6] << 16) | (in[7] << 24);
+            read = 8;
+        }
+        return true;
+    }
+
+    std::vector<uint8_t> WriteHeader(uint8_t type, uint32_t size){
+        std::vector<uint8_t> header = { type, static_cast<uint8_t>(size), static_cast<uint8_t>(size >> 8), static_cast<uint8_t>(size >> 16) };
+        if(size == 0 || size > 0xFFFFFF){
+            header[1] = header[2] = header[3] = 0;
+            for(int shift = 0; shift < 32; shift += 8){
+                header.push_back((size >> shift) & 0xFF);
+            }
+        }
+        return header;
+    }
+
+    // Shared by LZ10 and LZ11, which only differ in how a match is encoded
+    bool LZDecode(std::shared_ptr<File> target, uint8_t type){
+        std::shared_ptr<const uint8_t> payload = target->Lease();
+        const uint8_t* in = payload.get();
+        uint32_t inSize = target->GetSize();
+        uint32_t size, read;
+        if(!ReadHeader(in, inSize, type, size, read)){
+            return false;
+        }
+
+        // Nothing gets allocated for a size the data couldn't decode to. A match is at most 18
+        // bytes from 2 in LZ10 and 0x10110 from 4 in LZ11.
+        uint64_t available = inSize - read;
+        uint64_t limit = type == 0x10 ? available * 18 / 2 : available * 0x10110 / 4;
+        if(size > limit){
+            return false;
+        }
+
+        std::unique_ptr<uint8_t[]> out = std::make_unique_for_overwrite<uint8_t[]>(static_cast<std::size_t>(size) + 8);
+        uint32_t pos = 0;
+        while(pos < size){
+            if(read >= inSize){
+                return false;
+            }
+            uint8_t flags = in[read++];
+
+            for(uint8_t mask = 0x80; mask != 0 && pos < size; mask >>= 1){
+                if(!(flags & mask)){
+                    if(read >= inSize){
+                        return false;
+                    }
+                    out[pos++] = in[read++];
+                    continue;
+                }
+
+                if(read + 1 >= inSize){
+                    return false;
+                }
+
+                uint32_t length, disp;
+                uint8_t a = in[read++];
+                if(type == 0x10){
+                    length = (a >> 4) + 3;
+                    disp = ((a & 0x0F) << 8 | in[read++]) + 1;
+                } else if((a >> 4) == 0){
+                    if(read + 1 >= inSize){
+                        return false;
+                    }
+                    uint8_t b = in[read++], c = in[read++];
+                    length = ((a & 0x0F) << 4 | b >> 4) + 0x11;
+                    disp = ((b & 0x0F) << 8 | c) + 1;
+                } else if((a >> 4) == 1){
+                    if(read + 2 >= inSize){
+                        return false;
+                    }
+                    uint8_t b = in[read++], c = in[read++], d = in[read++];
+                    length = ((a & 0x0F) << 12 | b << 4 | c >> 4) + 0x111;
+                    disp = ((c & 0x0F) << 8 | d) + 1;
+                } else {
+                    length = (a >> 4) + 1;
+                    disp = ((a & 0x0F) << 8 | in[read++]) + 1;
+                }
+
+                if(disp > pos || length > size - pos){
+                    return false;
+                }
+                CopyMatch(out.get() + pos, disp, length);
+                pos += length;
+            }
+        }
+
+        target->SetData(std::move(out), size);
+        return true;
+    }
+
+    void LZEncode(std::shared_ptr<File> target, uint8_t type, Level level, uint32_t threads){
+        std::shared_ptr<const uint8_t> payload = target->Lease();
+        if(payload == nullptr){
+            return;
+        }
+        std::vector<uint8_t> data(payload.get(), payload.get() + target->GetSize());
+        std::vector<LZToken> tokens = Parse(data, type == 0x10 ? LZ10Format : LZ11Format, level, threads);
+
+        std::vector<uint8_t> packed = WriteHeader(type, data.size());
+        packed.reserve(packed.size() + data.size() + data.size() / 8 + 4);
+
+        std::size_t flagPos = 0;
+        uint32_t pos = 0;
+        for(std::size_t i = 0; i < tokens.size(); i++){
+            if(i % 8 == 0){
+                flagPos = packed.size();
+                packed.push_back(0);
+            }
+
+            const LZToken& token = tokens[i];
+            if(token.length == 0){
+                packed.push_back(data[pos++]);
+                continue;
+            }
+
+            uint32_t disp = token.disp - 1;
+            uint32_t length = token.length;
+            packed[flagPos] |= 0x80 >> (i % 8);
+            if(type == 0x10){
+                packed.push_back(((length - 3) << 4) | (disp >> 8));
+            } else if(length <= 0x10){
+                packed.push_back(((length - 1) << 4) | (disp >> 8));
+            } else if(length <= 0x110){
+                length -= 0x11;
+                packed.push_back(length >> 4);
+                packed.push_back(((length & 0x0F) << 4) | (disp >> 8));
+            } else {
+                length -= 0x111;
+                packed.push_back(0x10 | (length >> 12));
+                packed.push_back((length >> 4) & 0xFF);
+                packed.push_back(((length & 0x0F) << 4) | (disp >> 8));
+            }
+            packed.push_back(disp & 0xFF);
+            pos += token.length;
+        }
+
+        packed.resize((packed.size() + 3) & ~3, 0);
+        target->SetData(std::move(packed));
+    }
+
+    struct HuffmanNode {
+        uint32_t freq;
+        int32_t children[2] { -1, -1 };
+        uint8_t symbol { 0 };
+
+        bool IsLeaf() const { return children[0] < 0; }
+    };
+
+    // Lays the tree out the way the BIOS reads it: the size byte, the root, then pairs of
+    // siblings, each internal node holding its children's distance in pairs in 6 bits. Pairs
+    // are placed depth first to keep the number of nodes waiting on theirs small, except that
+    // a node getting within margin pairs of the 63 limit goes first.
+    bool LayoutHuffmanTree(const std::vector<HuffmanNode>& nodes, int32_t root, uint32_t margin, std::vector<uint8_t>& table){
+        struct Pending {
+            uint32_t deadline; // last pair its children can go in
+            uint32_t order;
+            int32_t node;
+            uint32_t slot;
+        };
+
+        table.assign(2, 0);
+        std::vector<Pending> pending = { { 64, 0, root, 1 } };
+        uint32_t order = 0;
+
+        while(!pending.empty()){
+            uint32_t pair = table.size() / 2;
+
+            auto next = std::min_element(pending.begin(), pending.end(), [](const Pending& a, const Pending& b){ return a.deadline < b.deadline; });
+            if(next->deadline - std::min(next->deadline, pair) > margin){
+                next = std::max_element(pending.begin(), pending.end(), [](const Pending& a, const Pending& b){ return a.order < b.order; });
+            }
+
+            Pending job = *next;
+            pending.erase(next);
+            if(pair > job.deadline){
+                return false;
+            }
+
+            const HuffmanNode& node = nodes[job.node];
+            table[job.slot] = (pair - job.slot / 2 - 1) | (nodes[node.children[0]].IsLeaf() ? 0x80 : 0) | (nodes[node.children[1]].IsLeaf() ? 0x40 : 0);
+            for(int32_t child : node.children){
+                if(nodes[child].IsLeaf()){
+                    table.push_back(nodes[child].symbol);
+                } else {
+                    pending.push_back({ pair + 64, ++order, child, static_cast<uint32_t>(table.size()) });
+                    table.push_back(0);
+                }
+            }
+        }
+
+        // the bitstream after the table has to start on a word
+        if(table.size() % 4 != 0){
+            table.resize(table.size() + 2, 0);
+        }
+        table[0] = table.size() / 2 - 1;
+        return true;
+    }
+
+    bool HuffmanEncode(std::shared_ptr<File> target, uint8_t symbolBits){
+        std::shared_ptr<const uint8_t> payload = target->Lease();
+        const uint8_t* data = payload.get();
+        uint32_t size = target->GetSize();
+        if(data == nullptr){
+            return false;
+        }
+        uint32_t symbolCount = symbolBits == 4 ? size * 2 : size;
+        auto symbolAt = [&](uint32_t i) -> uint8_t { return symbolBits == 4 ? (data[i / 2] >> ((i & 1) * 4)) & 0x0F : data[i]; };
+
+        std::vector<HuffmanNode> nodes(1 << symbolBits);
+        for(uint32_t i = 0; i < nodes.size(); i++){
+            nodes[i].freq = 0;
+            nodes[i].symbol = i;
+        }
+        for(uint32_t i = 0; i < symbolCount; i++){
+            nodes[symbolAt(i)].freq++;
+        }
+
+        // ties go to the older node so the output doesn't depend on the heap
+        using Entry = std::tuple<uint32_t, uint32_t, int32_t>;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+        for(uint32_t i = 0; i < nodes.size(); i++){
+            if(nodes[i].freq != 0){
+                queue.push({ nodes[i].freq, i, i });
+            }
+        }
+        // a tree needs two leaves
+        for(uint32_t i = 0; queue.size() < 2; i++){
+            if(nodes[i].freq == 0){
+                queue.push({ 0, i, i });
+            }
+        }
+
+        while(queue.size() > 1){
+            auto [freqA, orderA, a] = queue.top(); queue.pop();
+            auto [freqB, orderB, b] = queue.top(); queue.pop();
+
+            HuffmanNode parent;
+            parent.freq = freqA + freqB;
+            parent.children[0] = a;
+            parent.children[1] = b;
+            nodes.push_back(parent);
+            queue.push({ parent.freq, static_cast<uint32_t>(nodes.size() - 1), static_cast<int32_t>(nodes.size() - 1) });
+        }
+        int32_t root = std::get<2>(queue.top());
+
+        std::vector<uint8_t> table;
+        bool laidOut = false;
+        for(uint32_t margin : { 32, 16, 48, 8, 56 }){
+            if((laidOut = LayoutHuffmanTree(nodes, root, margin, table))){
+                break;
+            }
+        }
+        if(!laidOut){
+            return false;
+        }
+
+        // child 0 is a 0 bit, codes can be longer than a word for very skewed data
+        std::vector<std::pair<uint64_t, uint8_t>> codes(1 << symbolBits);
+        std::vector<std::tuple<int32_t, uint64_t, uint8_t>> stack = { { root, 0, 0 } };
+        while(!stack.empty()){
+            auto [node, code, length] = stack.back();
+            stack.pop_back();
+            if(nodes[node].IsLeaf()){
+                codes[nodes[node].symbol] = { code, length };
+                continue;
+            }
+            stack.push_back({ nodes[node].children[0], code << 1, length + 1 });
+            stack.push_back({ nodes[node].children[1], (code << 1) | 1, length + 1 });
+        }
+
+        std::vector<uint8_t> packed = WriteHeader(0x20 | symbolBits, size);
+        packed.insert(packed.end(), table.begin(), table.end());
+        packed.reserve(packed.size() + size + 4);
+
+        // filled from the top bit down, stored a little endian word at a time
+        uint64_t pending = 0;
+        uint32_t pendingBits = 0;
+        auto put = [&](uint64_t bits, uint32_t count){
+            pending = (pending << count) | bits;
+            pendingBits += count;
+            while(pendingBits >= 32){
+                uint32_t word = pending >> (pendingBits - 32);
+                pendingBits -= 32;
+                for(int shift = 0; shift < 32; shift += 8){
+                    packed.push_back((word >> shift) & 0xFF);
+                }
+            }
+        };
+
+        for(uint32_t i = 0; i < symbolCount; i++){
+            auto [code, length] = codes[symbolAt(i)];
+            if(length > 32){
+                put(code >> 32, length - 32);
+                length = 32;
+            }
+            put(code & ((uint64_t(1) << length) - 1), length);
+        }
+        if(pendingBits != 0){
+            put(0, 32 - pendingBits);
+        }
+
+        target->SetData(std::move(packed));
+        return true;
+    }
+
+    bool HuffmanDecode(std::shared_ptr<File> target){
+        std::shared_ptr<const uint8_t> payload = target->Lease();
+        const uint8_t* in = payload.get();
+        uint32_t inSize = target->GetSize();
+        if(in == nullptr || inSize < 6 || (in[0] != 0x24 && in[0] != 0x28)){
+            return false;
+        }
+
+        uint8_t symbolBits = in[0] & 0x0F;
+        uint32_t size, treeStart;
+        if(!ReadHeader(in, inSize, in[0], size, treeStart)){
+            return false;
+        }
+
+        uint32_t streamStart = treeStart + (in[treeStart] + 1) * 2;
+        if(streamStart > inSize){
+            return false;
+        }
+
+        // Codes up to LookupBits long decode in one lookup, an entry of length 0 holds the node
+        // the code continues from and the rest is walked a bit at a time
+        constexpr uint32_t LookupBits = 10;
+        struct Lookup {
+            uint16_t value;
+            uint8_t length;
+        };
+        std::vector<Lookup> lookup(1 << LookupBits, { 0, 0xFF });
+
+        auto child = [&](uint32_t node, uint32_t bit){ return (node & ~1u) + (in[node] & 0x3F) * 2 + 2 + bit; };
+        auto isLeaf = [&](uint32_t node, uint32_t bit){ return in[node] & (0x80 >> bit); };
+
+        std::vector<std::tuple<uint32_t, uint32_t, uint32_t>> stack = { { treeStart + 1, 0, 0 } };
+        while(!stack.empty()){
+            auto [node, code, length] = stack.back();
+            stack.pop_back();
+
+            for(uint32_t bit = 0; bit < 2; bit++){
+                uint32_t next = child(node, bit);
+                uint32_t nextCode = (code << 1) | bit;
+                if(next >= streamStart){
+                    return false;
+                }
+
+                if(isLeaf(node, bit)){
+                    uint32_t shift = LookupBits - (length + 1);
+                    for(uint32_t i = nextCode << shift; i < (nextCode + 1) << shift; i++){
+                        lookup[i] = { in[next], static_cast<uint8_t>(length + 1) };
+                    }
+                } else if(length + 1 == LookupBits){
+                    lookup[nextCode] = { static_cast<uint16_t>(next), 0 };
+                } else {
+                    stack.push_back({ next, nextCode, length + 1 });
+                }
+            }
+        }
+
+        // every symbol takes at least a bit of the stream
+        uint64_t symbolCount = symbolBits == 4 ? static_cast<uint64_t>(size) * 2 : size;
+        if(symbolCount > static_cast<uint64_t>(inSize - streamStart) * 8){
+            return false;
+        }
+        std::unique_ptr<uint8_t[]> out = std::make_unique<uint8_t[]>(size);
+
+        uint64_t bits = 0; // next bits from the top down
+        uint32_t bitCount = 0;
+        uint32_t read = streamStart;
+        uint64_t overrun = 0; // bits taken from past the end of the stream
+        auto refill = [&](){
+            while(bitCount <= 32){
+                uint32_t word = 0;
+                if(read + 4 <= inSize){
+                    word = in[read] | (in[read + 1] << 8) | (in[read + 2] << 16) | (in[read + 3] << 24);
+                    read += 4;
+                } else {
+                    overrun += 32;
+                }
+                bits |= static_cast<uint64_t>(word) << (32 - bitCount);
+                bitCount += 32;
+            }
+        };
+
+        for(uint64_t i = 0; i < symbolCount; i++){
+            refill();
+            Lookup entry = lookup[bits >> (64 - LookupBits)];
+            uint8_t symbol;
+            if(entry.length == 0xFF){
+                return false; // a code the tree doesn't have
+            } else if(entry.length != 0){
+                symbol = entry.value;
+                bits <<= entry.length;
+                bitCount -= entry.length;
+            } else {
+                bits <<= LookupBits;
+                bitCount -= LookupBits;
+                for(uint32_t node = entry.value;;){
+                    refill();
+                    uint32_t bit = bits >> 63;
+                    bits <<= 1;
+                    bitCount--;
+
+                    uint32_t next = child(node, bit);
+                    if(next >= streamStart){
+                        return false;
+                    }
+                    if(isLeaf(node, bit)){
+                        symbol = in[next];
+                        break;
+                    }
+                    node = next;
+                }
+            }
+
+            if(symbolBits == 4){
+                out[i / 2] |= (symbol & 0x0F) << ((i & 1) * 4);
+            } else {
+                out[i] = symbol;
+            }
+        }
+
+        // whatever was read ahead but not used doesn't count against the stream
+        if(overrun > bitCount){
+            return false;
+        }
+
+        target->SetData(std::move(out), size);
+        return true;
+    }
+
+    bool RLEDecode(std::shared_ptr<File> target){
+        std::shared_ptr<const uint8_t> payload = target->Lease();
+        const uint8_t* in = payload.get();
+        uint32_t inSize = target->GetSize();
+        uint32_t size, read;
+        if(!ReadHeader(in, inSize, 0x30, size, read)){
+            return false;
+        }
+
+        // a run is at most 130 bytes from 2
+        if(size > static_cast<uint64_t>(inSize - read) * 130 / 2){
+            return false;
+        }
+
+        std::unique_ptr<uint8_t[]> out = std::make_unique_for_overwrite<uint8_t[]>(size);
+        for(uint32_t pos = 0; pos < size;){
+            if(read >= inSize){
+                return false;
+            }
+
+            uint8_t flag = in[read++];
+            uint32_t length = (flag & 0x7F) + ((flag & 0x80) ? 3 : 1);
+            if(length > size - pos){
+                return false;
+            }
+
+            if(flag & 0x80){
+                if(read >= inSize){
+                    return false;
+                }
+                memset(out.get() + pos, in[read++], length);
+            } else {
+                if(length > inSize - read){
+                    return false;
+                }
+                memcpy(out.get() + pos, in + read, length);
+                read += length;
+            }
+            pos += length;
+        }
+
+        target->SetData(std::move(out), size);
+        return true;
+    }
+}
+
 // Based on https://github.com/Barubary/dsdecmp/blob/master/CSharp/DSDecmp/Formats/LZOvl.cs
 // thanksssss :3
-void BLZDecompress(std::shared_ptr<File> target){
-    bStream::CMemoryStream compressedStream(target->GetData(), target->GetSize(), bStream::Endianess::Little, bStream::OpenMode::In);
+bool BLZDecompress(std::shared_ptr<File> target){
+    std::shared_ptr<const uint8_t> payload = target->Lease();
+    const uint8_t* in = payload.get();
+    uint32_t size = target->GetSize();
+    if(in == nullptr){
+        std::cout << "[Palkia] Couldn't read " << target->GetName() << std::endl;
+        return false;
+    }
+    if(size < 8){
+        std::cout << "[Palkia] Invalid BLZ footer in " << target->GetName() << std::endl;
+        return false;
+    }
 
-    compressedStream.seek(target->GetSize()-0x08);
-    uint32_t info = compressedStream.readUInt32();
-    uint32_t extraSpace = compressedStream.readUInt32();
+    uint32_t info = in[size - 8] | (in[size - 7] << 8) | (in[size - 6] << 16) | (in[size - 5] << 24);
+    uint32_t extraSpace = in[size - 4] | (in[size - 3] << 8) | (in[size - 2] << 16) | (in[size - 1] << 24);
 
     if(extraSpace == 0){
-        return; // not compressedddddd
+        return true; // not compressed
     }
 
-
     uint32_t headerSize = (info >> 24);
-    uint32_t compressedSize = (info & 0xFFFFFF);
-    
-    if(compressedSize >= target->GetSize()){
-        compressedSize = target->GetSize();
-    }
-    
-    std::vector<uint8_t> mDecompressedData;
-    std::vector<uint8_t> mCompressedBuffer;
-    std::vector<uint8_t> mUncompressedData;
-
-    // grabs the uncompressed data at the start of the file
-    mUncompressedData.resize(target->GetSize() - compressedSize, 0);
-    compressedStream.seek(0);
-    compressedStream.readBytesTo(mUncompressedData.data(), mUncompressedData.size());
-
-    // output of decompressed data
-    mDecompressedData.resize(target->GetSize() + extraSpace - mUncompressedData.size(), 0);
-
-    // grabs the compressed data buffer
-    mCompressedBuffer.resize(compressedSize, 0);
-    compressedStream.seek(target->GetSize() - compressedSize - headerSize);
-    compressedStream.readBytesTo(mCompressedBuffer.data(), mCompressedBuffer.size());
-
-    uint32_t readBytes = 0, currentOutSize = 0;
-    uint32_t decompressedSize = mDecompressedData.size();
-    uint8_t mask = 1, flags = 0;
-    while(currentOutSize < decompressedSize){
-        if(mask == 1){
-            if(readBytes >= compressedSize){
-                std::cout << "[Palkia] BLZ ran out of data to decompress!" << std::endl;
-                return; // fuck
-            }
-
-            flags = mCompressedBuffer[mCompressedBuffer.size() - 1 - readBytes];
-            readBytes++;
+    uint32_t compressedSize = std::min(info & 0xFFFFFF, size);
+    // Nothing gets allocated for more than the data could decode to. Every flag byte and its
+    // 16 bytes of tokens give at most 8 matches of 18 bytes.
+    if(headerSize < 8 || headerSize > compressedSize || static_cast<uint64_t>(size) + extraSpace > UINT32_MAX || extraSpace > static_cast<uint64_t>(compressedSize) * 9){
+        std::cout << "[Palkia] Invalid BLZ footer in " << target->GetName() << std::endl;
+        return false;
+    }
+
+    // Decompressed the way the game does it, in place: the file goes at the start of a buffer
+    // of the final size and the output is written from the end down, always staying above
+    // the compressed bytes still to be read.
+    uint32_t outSize = size + extraSpace;
+    std::unique_ptr<uint8_t[]> out = std::make_unique_for_overwrite<uint8_t[]>(outSize);
+    memcpy(out.get(), in, size - headerSize);
+
+    const uint8_t* start = out.get() + size - compressedSize;
+    const uint8_t* read = out.get() + size - headerSize;
+    uint8_t* write = out.get() + outSize;
+    const uint8_t* end = write;
+
+    uint8_t mask = 0, flags = 0;
+    while(write > start){
+        if(mask == 0){
+            if(read <= start){
+                std::cout << "[Palkia] BLZ ran out of data in " << target->GetName() << std::endl;
+                return false;
+            }
+            flags = *--read;
             mask = 0x80;
-        } else {
-            mask >>= 1;
         }
 
-        if((flags & mask) > 0){
-            if(readBytes + 1 >= target->GetSize()){
-                std::cout << "[Palkia] Ran out of data to decompress" << std::endl;
-                return;
+        if(flags & mask){
+            if(read - start < 2){
+                std::cout << "[Palkia] BLZ ran out of data in " << target->GetName() << std::endl;
+                return false;
             }
-            uint8_t a = mCompressedBuffer[mCompressedBuffer.size() - 1 - readBytes]; readBytes++;
-            uint8_t b = mCompressedBuffer[mCompressedBuffer.size() - 1 - readBytes]; readBytes++;
+            uint8_t a = *--read;
+            uint8_t b = *--read;
 
-            uint8_t len = (a >> 4) + 3;
-            uint16_t disp = (((a & 0x0F) << 8) | b) + 3;
+            uint32_t length = std::min<uint32_t>((a >> 4) + 3, write - start);
+            uint32_t disp = (((a & 0x0F) << 8) | b) + 3;
 
-            if(disp > currentOutSize){
-                if(currentOutSize < 2){
-                    std::cout << "[Palkia] Invalid readback size!" << std::endl;
-                    return;
+            if(disp > static_cast<uint32_t>(end - write)){
+                if(end - write < 2){
+                    std::cout << "[Palkia] Invalid BLZ readback in " << target->GetName() << std::endl;
+                    return false;
                 }
                 disp = 2;
             }
 
-            uint32_t bufIdx = currentOutSize - disp;
-            for(uint32_t i = 0; i < len; i++){
-                uint8_t next = mDecompressedData[decompressedSize - 1 - bufIdx];
-                bufIdx++;
-                mDecompressedData[decompressedSize - 1 - currentOutSize] = next;
-                currentOutSize++;
+            // overlapping copies repeat the bytes just written, so this has to go a byte at a time
+            for(uint32_t i = 0; i < length; i++){
+                write--;
+                *write = write[disp];
+            }
+        } else {
+            if(read <= start){
+                std::cout << "[Palkia] BLZ ran out of data in " << target->GetName() << std::endl;
+                return false;
             }
+            *--write = *--read;
+        }
+        mask >>= 1;
+    }
+
+    target->SetData(std::move(out), outSize);
+    return true;
+}
+
+bool BLZCompress(std::shared_ptr<File> target, Level level, uint32_t rawPrefix, uint32_t threads){
+    uint32_t size = target->GetSize();
+    std::shared_ptr<const uint8_t> payload = target->Lease();
+    const uint8_t* data = payload.get();
+    if(data == nullptr || rawPrefix >= size){
+        return false;
+    }
+
+    // the format runs from the end of the file backwards, so match forwards on it reversed
+    std::vector<uint8_t> reversed(data + rawPrefix, data + size);
+    std::reverse(reversed.begin(), reversed.end());
+
+    std::vector<LZToken> tokens = Parse(reversed, BLZFormat, level, threads);
+
+    // Decompressing in place writes from the end of the buffer down towards the compressed data
+    // it's still reading. The writer stays ahead as long as no point before the cut has saved
+    // more than the cut itself, so cut where the saving peaks and leave the rest raw.
+    uint32_t produced = 0, consumed = 0;
+    uint32_t cut = 0, cutProduced = 0, cutConsumed = 0;
+    int64_t bestSaving = 0;
+    for(std::size_t i = 0; i < tokens.size(); i++){
+        consumed += (i % 8 == 0 ? 1 : 0) + (tokens[i].length == 0 ? 1 : 2);
+        produced += tokens[i].length == 0 ? 1 : tokens[i].length;
+
+        if(static_cast<int64_t>(produced) - consumed > bestSaving){
+            bestSaving = static_cast<int64_t>(produced) - consumed;
+            cut = i + 1;
+            cutProduced = produced;
+            cutConsumed = consumed;
+        }
+    }
+
+    // footer is two words plus padding that brings the whole file to a multiple of 4
+    uint32_t prefix = size - cutProduced;
+    uint32_t padding = (4 - (prefix + cutConsumed) % 4) % 4;
+    uint32_t headerSize = 8 + padding;
+    if(bestSaving <= headerSize){
+        return false;
+    }
+
+    // the footer only has 24 bits for the compressed part's size
+    uint32_t encodedSize = cutConsumed + headerSize;
+    if(encodedSize > 0xFFFFFF){
+        std::cout << "[Palkia] Too much to BLZ compress in " << target->GetName() << std::endl;
+        return false;
+    }
+
+    std::vector<uint8_t> packed;
+    packed.reserve(cutConsumed);
+    std::size_t flagPos = 0;
+    uint32_t pos = 0;
+    for(std::size_t i = 0; i < cut; i++){
+        if(i % 8 == 0){
+            flagPos = packed.size();
+            packed.push_back(0);
+        }
+
+        const LZToken& token = tokens[i];
+        if(token.length == 0){
+            packed.push_back(reversed[pos++]);
         } else {
-            uint8_t next = mCompressedBuffer[compressedSize - 1 - readBytes];
-            readBytes++;
-            mDecompressedData[decompressedSize - 1 - currentOutSize] = next;
-            currentOutSize++;
+            uint32_t disp = token.disp - BLZFormat.minDisp;
+            packed[flagPos] |= 0x80 >> (i % 8);
+            packed.push_back(((token.length - MinMatch) << 4) | (disp >> 8));
+            packed.push_back(disp & 0xFF);
+            pos += token.length;
         }
     }
 
     std::vector<uint8_t> result;
-    result.reserve(mDecompressedData.size() + mUncompressedData.size());
-    result.insert(result.end(), mUncompressedData.begin(), mUncompressedData.end());
-    std::cout << "[Palkia]: decompressed Data starts at 0x" << std::hex << result.size() << std::dec << std::endl;
-    result.insert(result.end(), mDecompressedData.begin(), mDecompressedData.end());
+    result.reserve(prefix + encodedSize);
+    result.insert(result.end(), data, data + prefix);
+    result.insert(result.end(), packed.rbegin(), packed.rend());
+    result.insert(result.end(), padding, 0xFF);
+
+    uint32_t info = encodedSize | (headerSize << 24);
+    uint32_t extraSpace = cutProduced - encodedSize;
+    for(uint32_t word : { info, extraSpace }){
+        for(int shift = 0; shift < 32; shift += 8){
+            result.push_back((word >> shift) & 0xFF);
+        }
+    }
+
+    target->SetData(std::move(result));
+    return true;
+}
 
-    target->SetData(result.data(), result.size());
+bool LZ10Decompress(std::shared_ptr<File> target){
+    if(!LZDecode(target, 0x10)){
+        std::cout << "[Palkia] Invalid LZ10 data in " << target->GetName() << std::endl;
+        return false;
+    }
+    return true;
 }
 
-void BLZCompress(std::shared_ptr<File> target){
-    
+bool LZ11Decompress(std::shared_ptr<File> target){
+    if(!LZDecode(target, 0x11)){
+        std::cout << "[Palkia] Invalid LZ11 data in " << target->GetName() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void LZ10Compress(std::shared_ptr<File> target, Level level, uint32_t threads){
+    LZEncode(target, 0x10, level, threads);
+}
+
+void LZ11Compress(std::shared_ptr<File> target, Level level, uint32_t threads){
+    LZEncode(target, 0x11, level, threads);
+}
+
+bool HuffmanDecompress(std::shared_ptr<File> target){
+    if(!HuffmanDecode(target)){
+        std::cout << "[Palkia] Invalid Huffman data in " << target->GetName() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool HuffmanCompress(std::shared_ptr<File> target, uint8_t symbolBits){
+    if(symbolBits != 4 && symbolBits != 8){
+        return false;
+    }
+    if(!HuffmanEncode(target, symbolBits)){
+        std::cout << "[Palkia] Couldn't fit the Huffman tree for " << target->GetName() << " in the BIOS format" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool RLEDecompress(std::shared_ptr<File> target){
+    if(!RLEDecode(target)){
+        std::cout << "[Palkia] Invalid RLE data in " << target->GetName() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void RLECompress(std::shared_ptr<File> target){
+    std::shared_ptr<const uint8_t> payload = target->Lease();
+    const uint8_t* data = payload.get();
+    uint32_t size = target->GetSize();
+    if(data == nullptr){
+        return;
+    }
+
+    std::vector<uint8_t> packed = WriteHeader(0x30, size);
+    packed.reserve(packed.size() + size + size / 128 + 4);
+
+    // runs of 3 to 130 become a flag and a byte, anything between goes out raw 128 at a time
+    uint32_t literalStart = 0;
+    auto flushLiterals = [&](uint32_t end){
+        while(literalStart < end){
+            uint32_t length = std::min<uint32_t>(end - literalStart, 0x80);
+            packed.push_back(length - 1);
+            packed.insert(packed.end(), data + literalStart, data + literalStart + length);
+            literalStart += length;
+        }
+    };
+
+    for(uint32_t pos = 0; pos < size;){
+        uint32_t run = 1;
+        while(run < 0x82 && pos + run < size && data[pos + run] == data[pos]){
+            run++;
+        }
+
+        if(run < 3){
+            pos += run;
+            continue;
+        }
+
+        flushLiterals(pos);
+        packed.push_back(0x80 | (run - 3));
+        packed.push_back(data[pos]);
+        pos += run;
+        literalStart = pos;
+    }
+    flushLiterals(size);
+
+    packed.resize((packed.size() + 3) & ~3, 0);
+    target->SetData(std::move(packed));
+}
+
+bool AutoDecompress(std::shared_ptr<File> target){
+    std::shared_ptr<const uint8_t> payload = target->Lease();
+    const uint8_t* data = payload.get();
+    if(data == nullptr || target->GetSize() < 4){
+        return false;
+    }
+
+    switch(data[0]){
+        case 0x10:
+        case 0x11:
+            return LZDecode(target, data[0]);
+        case 0x24:
+        case 0x28:
+            return HuffmanDecode(target);
+        case 0x30:
+            return RLEDecode(target);
+        default:
+            return false;
+    }
 }
 
 }
\ No newline at end of file
@@ -0,0 +1,370 @@
+#include "NDS/System/FileSystem.hpp"
+#include "NDS/System/Manifest.hpp"
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <utility>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#ifdef PALKIA_IO_URING
+#include <liburing.h>
+#endif
+
+namespace Palkia::Nitro {
+
+namespace {
+	using DumpEntry = std::pair<std::filesystem::path, File*>;
+
+	// Payload to write for a file, lazily opened files are read into scratch rather than kept loaded
+	const uint8_t* Payload(File& file, std::vector<uint8_t>& scratch){
+		if(file.IsLoaded()){
+			return std::as_const(file).GetData();
+		}
+		scratch.resize(file.GetSize());
+		return file.ReadBytes(0, scratch.data(), file.GetSize()) ? scratch.data() : nullptr;
+	}
+
+#ifndef _WIN32
+	bool WriteAll(int fd, const uint8_t* data, std::size_t size){
+		for(std::size_t written = 0; written < size;){
+			ssize_t r = write(fd, data + written, size - written);
+			if(r <= 0){
+				return false;
+			}
+			written += r;
+		}
+		return true;
+	}
+
+	// Copies an untouched payload from its source image to fd without it passing through
+	// this process, or through the image's mapping. Whatever the kernel won't copy is read
+	// into scratch instead.
+	bool CopyFromSource(int fd, File& file, std::vector<uint8_t>& scratch){
+		std::shared_ptr<Image> source = file.GetSource();
+		std::size_t offset = file.GetSourceOffset();
+		std::size_t left = file.GetSize();
+
+#ifdef __linux__
+		off_t in = offset;
+		while(left > 0){
+			ssize_t r = copy_file_range(source->GetFd(), &in, fd, nullptr, left, 0);
+			if(r <= 0) break;
+			left -= r;
+		}
+
+		// copy_file_range is missing on older kernels and refused across some filesystems
+		while(left > 0){
+			ssize_t r = sendfile(fd, source->GetFd(), &in, left);
+			if(r <= 0) break;
+			left -= r;
+		}
+		offset = in;
+#endif
+
+		if(left == 0){
+			return true;
+		}
+
+		scratch.resize(left);
+		return source->Read(offset, scratch.data(), left) && WriteAll(fd, scratch.data(), left);
+	}
+
+	bool CanCopyFromSource(File& file){
+		std::shared_ptr<Image> source = file.GetSource();
+		return source != nullptr && source->GetFd() >= 0;
+	}
+#endif
+
+	bool WriteEntry(const std::filesystem::path& path, File& file, std::vector<uint8_t>& scratch){
+#ifndef _WIN32
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(fd < 0){
+			return false;
+		}
+
+		if(CanCopyFromSource(file)){
+			bool copied = CopyFromSource(fd, file, scratch);
+			return close(fd) == 0 && copied;
+		}
+
+		const uint8_t* data = Payload(file, scratch);
+		if(data == nullptr && file.GetSize() != 0){
+			close(fd);
+			return false;
+		}
+
+		bool written = WriteAll(fd, data, file.GetSize());
+		return close(fd) == 0 && written;
+#else
+		const uint8_t* data = Payload(file, scratch);
+		if(data == nullptr && file.GetSize() != 0){
+			return false;
+		}
+
+		bStream::CFileStream out(path.string(), bStream::OpenMode::Out);
+		out.writeBytes(const_cast<uint8_t*>(data), file.GetSize());
+		return true;
+#endif
+	}
+
+	// Runs work(i, scratch) for every i below count on up to threads threads, each with its own scratch buffer
+	template<typename Work>
+	void ParallelFor(std::size_t count, uint32_t threads, Work&& work){
+		if(threads == 0){
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+
+		std::atomic<std::size_t> next { 0 };
+		auto run = [&](){
+			std::vector<uint8_t> scratch;
+			for(std::size_t i = next++; i < count; i = next++){
+				work(i, scratch);
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for(uint32_t t = 1; t < threads && t < count; t++){
+			workers.emplace_back(run);
+		}
+		run();
+
+		for(auto& worker : workers){
+			worker.join();
+		}
+	}
+
+	bool WriteThreaded(std::vector<DumpEntry>& files, uint32_t threads){
+		std::atomic<bool> ok { true };
+		ParallelFor(files.size(), threads, [&](std::size_t i, std::vector<uint8_t>& scratch){
+			if(!WriteEntry(files[i].first, *files[i].second, scratch)){
+				std::cout << "Couldn't write " << files[i].first << std::endl;
+				ok = false;
+			}
+		});
+		return ok;
+	}
+
+	// Hashes are worked out in parallel, each file only once however often it's asked for.
+	// Without fingerprints no payload is touched, IDs and paths are all Import needs.
+	Manifest Fingerprint(std::vector<DumpEntry>& files, const std::filesystem::path& base, uint32_t threads, bool fingerprints = true){
+		if(fingerprints){
+			ParallelFor(files.size(), threads, [&](std::size_t i, std::vector<uint8_t>&){
+				files[i].second->GetHash();
+			});
+		}
+
+		Manifest manifest;
+		manifest.SetFingerprints(fingerprints);
+		for(auto& [path, file] : files){
+			manifest.Add({ file->GetID(), file->GetSize(), fingerprints ? file->GetHash() : 0, path.lexically_relative(base).generic_string() });
+		}
+		return manifest;
+	}
+
+#ifdef PALKIA_IO_URING
+	// Opens, writes and closes depth files at a time, each step submitted as one batch.
+	// False only when no ring could be set up, write failures are reported through ok.
+	// Every file needs a buffer to hand the ring, ones copied from their source go elsewhere.
+	bool WriteUring(std::vector<DumpEntry>& files, uint32_t depth, bool& ok){
+		io_uring ring;
+		if(io_uring_queue_init(depth, &ring, 0) < 0){
+			return false;
+		}
+
+		std::vector<int> fds(depth);
+		std::vector<std::vector<uint8_t>> scratch(depth);
+
+		// submits whatever was queued and hands each of the count results to onResult(slot, res)
+		auto complete = [&](uint32_t count, auto&& onResult){
+			io_uring_submit(&ring);
+			for(uint32_t n = 0; n < count; n++){
+				io_uring_cqe* cqe;
+				if(io_uring_wait_cqe(&ring, &cqe) < 0){
+					ok = false;
+					return;
+				}
+				onResult(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(io_uring_cqe_get_data(cqe))), cqe->res);
+				io_uring_cqe_seen(&ring, cqe);
+			}
+		};
+
+		for(std::size_t base = 0; base < files.size(); base += depth){
+			uint32_t count = std::min<std::size_t>(depth, files.size() - base);
+
+			for(uint32_t slot = 0; slot < count; slot++){
+				io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+				io_uring_prep_openat(sqe, AT_FDCWD, files[base + slot].first.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+				io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(uintptr_t(slot)));
+			}
+			complete(count, [&](uint32_t slot, int res){
+				fds[slot] = res;
+				if(res < 0){
+					std::cout << "Couldn't open " << files[base + slot].first << std::endl;
+					ok = false;
+				}
+			});
+
+			uint32_t writes = 0;
+			for(uint32_t slot = 0; slot < count; slot++){
+				if(fds[slot] < 0) continue;
+				File& file = *files[base + slot].second;
+				const uint8_t* data = Payload(file, scratch[slot]);
+				if(data == nullptr && file.GetSize() != 0){
+					std::cout << "Couldn't read " << files[base + slot].first << std::endl;
+					ok = false;
+					continue;
+				}
+
+				io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+				io_uring_prep_write(sqe, fds[slot], data, file.GetSize(), 0);
+				io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(uintptr_t(slot)));
+				writes++;
+			}
+			complete(writes, [&](uint32_t slot, int res){
+				File& file = *files[base + slot].second;
+				if(res < 0){
+					std::cout << "Couldn't write " << files[base + slot].first << std::endl;
+					ok = false;
+					return;
+				}
+
+				// short writes are rare enough to just finish off here
+				const uint8_t* data = file.IsLoaded() ? std::as_const(file).GetData() : scratch[slot].data();
+				for(std::size_t written = res; written < file.GetSize();){
+					ssize_t r = pwrite(fds[slot], data + written, file.GetSize() - written, written);
+					if(r <= 0){
+						ok = false;
+						break;
+					}
+					written += r;
+				}
+			});
+
+			uint32_t closes = 0;
+			for(uint32_t slot = 0; slot < count; slot++){
+				if(fds[slot] < 0) continue;
+				io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+				io_uring_prep_close(sqe, fds[slot]);
+				io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(uintptr_t(slot)));
+				closes++;
+			}
+			complete(closes, [&](uint32_t, int res){
+				if(res < 0) ok = false;
+			});
+		}
+
+		io_uring_queue_exit(&ring);
+		return true;
+	}
+#endif
+
+	// Every directory is made up front, parents first, so writers never touch the directory tree
+	bool WriteOut(std::vector<std::filesystem::path>& dirs, std::vector<DumpEntry>& files, uint32_t threads){
+		for(std::size_t i = 0; i < dirs.size(); i++){
+			if(dirs[i].empty()) continue;
+			const std::filesystem::path& dir = dirs[i];
+			std::error_code err;
+			if(i == 0){
+				std::filesystem::create_directories(dir, err);
+			} else {
+				std::filesystem::create_directory(dir, err); // parent was made just before
+			}
+			if(err){
+				std::cout << "Couldn't create " << dir << ": " << err.message() << std::endl;
+				return false;
+			}
+		}
+
+		if(threads == 0){
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+
+#ifdef PALKIA_IO_URING
+		// The kernel copies untouched files itself with nothing for the ring to do, so those are
+		// spread over threads first. A ring keeps far more small files in flight than threads would.
+		std::vector<DumpEntry> copied, buffered;
+		for(auto& entry : files){
+			(CanCopyFromSource(*entry.second) ? copied : buffered).push_back(entry);
+		}
+
+		bool ok = WriteThreaded(copied, threads);
+		if(WriteUring(buffered, std::max(threads * 8, 32u), ok)){
+			return ok;
+		}
+		return WriteThreaded(buffered, threads) && ok;
+#endif
+
+		return WriteThreaded(files, threads);
+	}
+}
+
+bool File::Export(std::filesystem::path path){
+	std::vector<uint8_t> scratch;
+	if(!WriteEntry(path, *this, scratch)){
+		std::cout << "Couldn't write " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void Folder::ListTree(const std::filesystem::path& out_path, std::vector<std::filesystem::path>& dirs, std::vector<std::pair<std::filesystem::path, File*>>& files){
+	dirs.push_back(out_path);
+
+	for(auto& directory : mFolders){
+		directory->ListTree(out_path / directory->GetName(), dirs, files);
+	}
+
+	for(auto& file : mFiles){
+		files.push_back({ out_path / file->GetName(), file.get() });
+	}
+}
+
+bool Folder::Dump(std::filesystem::path out_path, uint32_t threads){
+	std::vector<std::filesystem::path> dirs;
+	std::vector<DumpEntry> files;
+	ListTree(out_path, dirs, files);
+
+	return WriteOut(dirs, files, threads);
+}
+
+void FileSystem::ListTree(const std::filesystem::path& out_path, std::vector<std::filesystem::path>& dirs, std::vector<std::pair<std::filesystem::path, File*>>& files){
+	if(mHasFNT && mRoot != nullptr){
+		mRoot->ListTree(out_path, dirs, files);
+		return;
+	}
+
+	dirs.push_back(out_path);
+	for(auto& file : mFiles){
+		files.push_back({ out_path / file->GetName(), file.get() });
+	}
+}
+
+bool FileSystem::Dump(std::filesystem::path out_path, uint32_t threads, bool fingerprints){
+	std::vector<std::filesystem::path> dirs;
+	std::vector<DumpEntry> files;
+	ListTree(out_path, dirs, files);
+
+	if(!WriteOut(dirs, files, threads)){
+		return false;
+	}
+
+	return Fingerprint(files, out_path, threads, fingerprints).Save(out_path / Manifest::FileName);
+}
+
+Manifest FileSystem::BuildManifest(uint32_t threads){
+	std::vector<std::filesystem::path> dirs;
+	std::vector<DumpEntry> files;
+	ListTree("", dirs, files);
+
+	return Fingerprint(files, "", threads);
+}
+
+}
@@ -1,120 +1,413 @@
 #include "Util.hpp"
 #include "NDS/System/FileSystem.hpp"
 #include <algorithm>
+#include <unordered_map>
 
 namespace Palkia::Nitro {
 
 void File::SetData(uint8_t* data, size_t size){
-	if(mData != nullptr){
-		delete[] mData;
-	}
+	DropCache();
+
+	std::shared_ptr<uint8_t[]> buffer = std::make_shared_for_overwrite<uint8_t[]>(size);
+	memcpy(buffer.get(), data, size);
 
 	mSize = size;
-	mData = new uint8_t[size];
-	memcpy(mData, data, size);
+	mData = buffer.get();
+	mStorage = buffer;
+	mOwnsData = true;
+	mDirty = true;
+	mSource = nullptr;
+	mHashed = false;
+	mShared = false;
+}
+
+void File::SetData(std::vector<uint8_t>&& data){
+	DropCache();
+
+	std::shared_ptr<std::vector<uint8_t>> buffer = std::make_shared<std::vector<uint8_t>>(std::move(data));
+
+	mSize = buffer->size();
+	mData = buffer->data();
+	mStorage = buffer;
+	mOwnsData = true;
+	mDirty = true;
+	mSource = nullptr;
+	mHashed = false;
+	mShared = false;
+}
+
+void File::SetData(std::unique_ptr<uint8_t[]> data, std::size_t size){
+	DropCache();
+
+	std::shared_ptr<uint8_t[]> buffer = std::move(data);
+
+	mSize = size;
+	mData = buffer.get();
+	mStorage = buffer;
+	mOwnsData = true;
+	mDirty = true;
+	mSource = nullptr;
+	mHashed = false;
+	mShared = false;
+}
+
+bool File::ReadBytes(uint32_t offset, uint8_t* dst, uint32_t size) const {
+	if(offset > mSize || size > mSize - offset){
+		return false;
+	}
+
+	if(uint8_t* data = LoadedData(); data != nullptr || mSource == nullptr){
+		memcpy(dst, data + offset, size);
+		return true;
+	}
+
+	// a leased copy is cheaper than the image, held on to here in case the cache drops it meanwhile
+	std::shared_ptr<uint8_t[]> leased;
+	{
+		std::lock_guard<std::mutex> lock(mLoadLock);
+		leased = mLeased;
+		if(leased != nullptr && mCached){
+			PayloadCache::Touch(const_cast<File*>(this));
+		}
+	}
+	if(leased != nullptr){
+		memcpy(dst, leased.get() + offset, size);
+		return true;
+	}
+
+	return mSource->Read(mSourceOffset + offset, dst, size);
+}
+
+uint64_t File::GetHash(){
+	if(mHashed){
+		return mHash;
+	}
+
+	if(const uint8_t* data = LoadedData(); data != nullptr || mSource == nullptr){
+		mHash = Hash64(data, mSize);
+	} else {
+		Hasher64 hasher;
+		std::vector<uint8_t> chunk(std::min<uint32_t>(mSize, 0x10000));
+		for(uint32_t read = 0; read < mSize; read += chunk.size()){
+			uint32_t size = std::min<uint32_t>(mSize - read, chunk.size());
+			if(!ReadBytes(read, chunk.data(), size)){
+				return 0; // not kept, a later call can try again
+			}
+			hasher.Update(chunk.data(), size);
+		}
+		mHash = hasher.Digest();
+	}
+
+	mHashed = true;
+	return mHash;
+}
+
+bool File::ContentEquals(std::shared_ptr<File> other){
+	if(mSize != other->mSize || (mHashed && other->mHashed && mHash != other->mHash)){
+		return false;
+	}
+
+	const uint8_t* data = LoadedData();
+	const uint8_t* otherData = other->LoadedData();
+	if((data != nullptr || mSource == nullptr) && (otherData != nullptr || other->mSource == nullptr)){
+		return mSize == 0 || memcmp(data, otherData, mSize) == 0;
+	}
+
+	std::vector<uint8_t> a(std::min<uint32_t>(mSize, 0x10000)), b(a.size());
+	for(uint32_t read = 0; read < mSize; read += a.size()){
+		uint32_t size = std::min<uint32_t>(mSize - read, a.size());
+		if(!ReadBytes(read, a.data(), size) || !other->ReadBytes(read, b.data(), size)){
+			return false; // unreadable files are never treated as duplicates
+		}
+		if(memcmp(a.data(), b.data(), size) != 0){
+			return false;
+		}
+	}
+	return true;
+}
+
+uint8_t* File::Materialize(){
+	std::lock_guard<std::mutex> lock(mLoadLock);
+	if(mData == nullptr){
+		Load();
+	}
+	return mData; // or another reader got here first
+}
+
+uint8_t* File::Unshare(){
+	std::lock_guard<std::mutex> lock(mLoadLock);
+	if(mShared && mData != nullptr){
+		std::shared_ptr<uint8_t[]> buffer = std::make_shared_for_overwrite<uint8_t[]>(mSize);
+		memcpy(buffer.get(), mData, mSize);
+		mStorage = buffer;
+		mOwnsData = true;
+		std::atomic_ref<uint8_t*>(mData).store(buffer.get(), std::memory_order_release);
+	}
+	mShared = false;
+
+	if(mData == nullptr && mSource != nullptr){
+		Load();
+	}
+	return mData;
+}
+
+bool File::Load(){
+	if(mSource->IsMapped()){
+		mStorage = mSource;
+		std::atomic_ref<uint8_t*>(mData).store(mSource->GetData() + mSourceOffset, std::memory_order_release);
+		return true;
+	}
+
+	// a leased copy is taken out of the cache for good, otherwise it's read again. Left
+	// unloaded on failure, the next reader tries again.
+	std::shared_ptr<uint8_t[]> buffer = mLeased;
+	if(buffer != nullptr){
+		if(mCached){
+			PayloadCache::Forget(this);
+		}
+		mLeased = nullptr;
+	} else {
+		buffer = std::make_shared_for_overwrite<uint8_t[]>(mSize);
+		if(!mSource->Read(mSourceOffset, buffer.get(), mSize)){
+			return false;
+		}
+	}
+
+	mStorage = buffer;
+	mOwnsData = true;
+
+	// published last, readers that see it also see the storage behind it
+	std::atomic_ref<uint8_t*>(mData).store(buffer.get(), std::memory_order_release);
+	return true;
+}
+
+std::shared_ptr<const uint8_t> File::Lease(){
+	std::lock_guard<std::mutex> lock(mLoadLock);
+	if(mData != nullptr || mSource == nullptr){
+		return std::shared_ptr<const uint8_t>(mStorage, mData);
+	}
+
+	// mappings are paged by the kernel and changed files have nowhere to be read back from
+	if(mSource->IsMapped() || !mMatchesSource || mDirty){
+		if(!Load()){
+			return nullptr;
+		}
+		return std::shared_ptr<const uint8_t>(mStorage, mData);
+	}
+
+	if(mLeased != nullptr){
+		if(mCached){
+			PayloadCache::Touch(this);
+		}
+	} else {
+		std::shared_ptr<uint8_t[]> buffer = std::make_shared_for_overwrite<uint8_t[]>(mSize);
+		if(!mSource->Read(mSourceOffset, buffer.get(), mSize)){
+			return nullptr;
+		}
+		mLeased = buffer;
+		PayloadCache::Loaded(this);
+	}
+	return std::shared_ptr<const uint8_t>(mLeased, mLeased.get());
+}
+
+std::string PathIndex::Key(std::filesystem::path path){
+	std::string key = path.generic_string();
+	std::size_t start = key.find_first_not_of('/');
+	return start == std::string::npos ? "" : key.substr(start);
+}
+
+std::string Folder::GetPath(){
+	std::string path;
+	std::shared_ptr<Folder> dir = GetPtr();
+	for(std::shared_ptr<Folder> parent = dir->mParent.lock(); parent != nullptr; parent = dir->mParent.lock()){
+		path = path.empty() ? dir->mName : dir->mName + "/" + path;
+		dir = parent;
+	}
+	return path;
+}
+
+void Folder::Index(std::shared_ptr<PathIndex> index, std::string path){
+	mIndex = index;
+	index->folders[path] = GetPtr();
+
+	for(auto& file : mFiles){
+		index->files[PathIndex::Join(path, file->GetName())] = file;
+	}
+
+	for(auto& folder : mFolders){
+		folder->Index(index, PathIndex::Join(path, folder->mName));
+	}
 }
 
 std::shared_ptr<File> Folder::AddFile(std::shared_ptr<File> file){
 	mFiles.push_back(file);
+
+	if(auto index = mIndex.lock()){
+		index->files[PathIndex::Join(GetPath(), file->GetName())] = file;
+		file->SetID(index->ids.size());
+		index->ids.push_back(file);
+	}
+
 	return mFiles.back();
 }
 
 void Folder::AddFolder(std::shared_ptr<Folder> folder){
 	mFolders.push_back(folder);
 	folder->mParent = GetPtr();
+
+	if(auto index = mIndex.lock()){
+		folder->Index(index, PathIndex::Join(GetPath(), folder->mName));
+		folder->VisitFiles([&](const std::shared_ptr<File>& file){
+			file->SetID(index->ids.size());
+			index->ids.push_back(file);
+		});
+	}
+}
+
+void Folder::ForEachFile(std::function<void(std::shared_ptr<File>)> OnFile){
+	VisitFiles(OnFile);
+}
+
+void Folder::Traverse(std::function<void(std::shared_ptr<Folder>)> OnFolder, std::function<void(std::shared_ptr<File>)> OnFile){
+	Visit(OnFolder, OnFile);
+}
+
+FileSystem::FileSystem(){}
+FileSystem::~FileSystem(){}
+
+void FileSystem::Traverse(std::function<void(std::shared_ptr<Folder>)> OnFolder, std::function<void(std::shared_ptr<File>)> OnFile){
+	Visit(OnFolder, OnFile);
 }
 
-void Folder::Dump(std::filesystem::path out_path){
-	for (auto& directory : mFolders){
-        std::filesystem::create_directory(out_path / directory->GetName());
-        directory->Dump(out_path / directory->GetName());
+void FileSystem::ForEachFile(std::function<void(std::shared_ptr<File>)> OnFile){
+	VisitFiles(OnFile);
+}
+
+
+std::shared_ptr<File> Folder::GetFile(std::filesystem::path path){
+    if(path.begin() == path.end()) return nullptr;
+
+    // walk down the folders named by all but the last component
+    Folder* dir = this;
+    auto last = std::prev(path.end());
+    for(auto it = path.begin(); it != last; it++){
+        std::string name = it->string();
+        auto next = std::find_if(dir->mFolders.begin(), dir->mFolders.end(), [&](std::shared_ptr<Folder>& f){ return f->mName == name; });
+        if(next == dir->mFolders.end()) return nullptr;
+        dir = next->get();
     }
 
-    for (auto& file : mFiles){
-        bStream::CFileStream out(out_path / file->GetName(), bStream::OpenMode::Out);
-        out.writeBytes(file->GetData(), file->GetSize());
+    std::string name = last->string();
+    for(auto& file : dir->mFiles){
+        if(file->GetName() == name){
+            return file;
+        }
     }
-    
+
+    return nullptr;
 }
 
-void Folder::ForEachFile(std::function<void(std::shared_ptr<File>)> OnFile){
-	for (auto folder : mFolders){
-		folder->ForEachFile(OnFile);
+void FileSystem::Reindex(){
+	std::shared_ptr<PathIndex> index = std::make_shared<PathIndex>();
+	if(mRoot != nullptr){
+		mRoot->Index(index, "");
 	}
-		
-	for (auto file : mFiles){
-		OnFile(file);
+
+	// ids don't depend on names, keep them so files outside the tree stay reachable
+	if(mIndex != nullptr){
+		index->ids = std::move(mIndex->ids);
+	} else {
+		VisitFiles([&](const std::shared_ptr<File>& file){
+			if(file->GetID() >= index->ids.size()) index->ids.resize(file->GetID() + 1);
+			index->ids[file->GetID()] = file;
+		});
 	}
+
+	mIndex = index;
 }
 
-void Folder::Traverse(std::function<void(std::shared_ptr<Folder>)> OnFolder, std::function<void(std::shared_ptr<File>)> OnFile){
-	OnFolder(GetPtr());
-	for (auto folder : mFolders){
-		folder->Traverse(OnFolder, OnFile);
+void FileSystem::Find(Folder& dir, const Glob& pattern, const std::vector<uint16_t>& states, std::string_view magic, std::vector<uint8_t>& head, std::vector<File*>& results){
+	for(auto& file : dir.mFiles){
+		if(!pattern.MatchFile(states, file->GetName())){
+			continue;
+		}
+		if(!magic.empty() && (file->GetSize() < magic.size() || !file->ReadBytes(0, head.data(), magic.size()) || memcmp(head.data(), magic.data(), magic.size()) != 0)){
+			continue;
+		}
+		results.push_back(file.get());
 	}
-		
-	for (auto file : mFiles){
-		OnFile(file);
+
+	std::vector<uint16_t> next;
+	for(auto& folder : dir.mFolders){
+		pattern.Enter(states, folder->mName, next);
+		if(!next.empty()){
+			Find(*folder, pattern, next, magic, head, results);
+		}
 	}
 }
 
-FileSystem::FileSystem(){}
-FileSystem::~FileSystem(){}
+std::span<File* const> FileSystem::Find(const Glob& pattern, std::vector<File*>& results, std::string_view magic){
+	std::size_t first = results.size();
+	std::vector<uint8_t> head(magic.size());
 
-void FileSystem::Traverse(std::function<void(std::shared_ptr<Folder>)> OnFolder, std::function<void(std::shared_ptr<File>)> OnFile){
-	if(!mHasFNT){
-		ForEachFile(OnFile);
+	if(mHasFNT && mRoot != nullptr){
+		Find(*mRoot, pattern, pattern.Start(), magic, head, results);
 	} else {
-		mRoot->Traverse(OnFolder, OnFile);
+		Folder flat;
+		flat.mFiles = mFiles;
+		Find(flat, pattern, pattern.Start(), magic, head, results);
 	}
+
+	return std::span<File* const>(results).subspan(first);
 }
 
-void FileSystem::ForEachFile(std::function<void(std::shared_ptr<File>)> OnFile){
+void FileSystem::SetIDTable(const std::vector<std::shared_ptr<File>>& files){
+	if(mIndex == nullptr){
+		Reindex();
+	}
+	mIndex->ids.assign(files.begin(), files.end());
+}
+
+std::shared_ptr<File> FileSystem::GetFileByID(uint32_t id){
 	if(!mHasFNT){
-		for (auto file : mFiles){
-			OnFile(file);
-		}
+		return id < mFiles.size() ? mFiles[id] : nullptr;
 	}
-	else {
-		mRoot->ForEachFile(OnFile);
+
+	if(mIndex == nullptr){
+		Reindex();
 	}
-	
 
+	return id < mIndex->ids.size() ? mIndex->ids[id].lock() : nullptr;
 }
 
+std::shared_ptr<File> FileSystem::GetFile(std::filesystem::path path){
+	if(!mHasFNT || mRoot == nullptr){
+		std::string name = PathIndex::Key(path);
+		for(auto& file : mFiles){
+			if(file->GetName() == name) return file;
+		}
+		return nullptr;
+	}
 
-std::shared_ptr<File> Folder::GetFile(std::filesystem::path path){
-    if(path.begin() == path.end()) return nullptr;
-
-    for(auto file : mFiles){
-        if(file->GetName() == path.begin()->string()){
-            if(((++path.begin()) == path.end())){
-                return file;
-            }
-        }
-    }
+	if(mIndex == nullptr){
+		Reindex();
+	}
 
-    std::shared_ptr<File> file = nullptr;
+	auto entry = mIndex->files.find(PathIndex::Key(path));
+	return entry != mIndex->files.end() ? entry->second.lock() : nullptr;
+}
 
-    for(auto dir : mFolders){
-        if(dir->GetName() == path.begin()->string()){
-            std::filesystem::path subPath;
-            for(auto it = (++path.begin()); it != path.end(); it++) subPath  = subPath / it->string();
-            file = dir->GetFile(subPath);
-        }
-    }
+std::shared_ptr<Folder> FileSystem::GetFolder(std::filesystem::path path){
+	if(mRoot == nullptr){
+		return nullptr;
+	}
 
-    return file;
-}
+	if(mIndex == nullptr){
+		Reindex();
+	}
 
-std::shared_ptr<File> FileSystem::GetFile(std::filesystem::path path){
-    if(path.begin()->string() != "/"){
-        return mRoot->GetFile(path);
-    } else {
-        std::filesystem::path subPath;
-        for(auto it = (++path.begin()); it != path.end(); it++) subPath  = subPath / it->string();
-        return mRoot->GetFile(subPath);
-    }
+	auto entry = mIndex->folders.find(PathIndex::Key(path));
+	return entry != mIndex->folders.end() ? entry->second.lock() : nullptr;
 }
 
 std::shared_ptr<Folder> FileSystem::ParseDirectory(bStream::CStream& strm, std::vector<std::shared_ptr<File>>& files, uint16_t id, std::string path, std::shared_ptr<Folder> parent){
@@ -170,7 +463,15 @@ std::shared_ptr<Folder> FileSystem::ParseDirectory(bStream::CStream& strm, std::
 std::shared_ptr<Folder> FileSystem::ParseFNT(bStream::CStream& strm, uint32_t fntSize, std::vector<std::shared_ptr<File>>& files){
 	bStream::CMemoryStream fntBuffer = bStream::CMemoryStream(fntSize, bStream::Endianess::Little, bStream::OpenMode::In);
 	strm.readBytesTo(fntBuffer.getBuffer(), fntSize);
-	return ParseDirectory(fntBuffer, files, 0, "", nullptr);
+
+	std::shared_ptr<Folder> root = ParseDirectory(fntBuffer, files, 0, "", nullptr);
+	if(root != nullptr){
+		mIndex = std::make_shared<PathIndex>();
+		root->Index(mIndex, "");
+		mIndex->ids.assign(files.begin(), files.end());
+	}
+
+	return root;
 }
 
 std::vector<std::pair<uint32_t, uint32_t>> FileSystem::ParseFAT(bStream::CStream& strm, uint32_t entryCount){
@@ -182,53 +483,109 @@ std::vector<std::pair<uint32_t, uint32_t>> FileSystem::ParseFAT(bStream::CStream
 	return files;
 }
 
-void FileSystem::WriteDirectory(bStream::CStream& folderStream, bStream::CStream& dataStream, std::shared_ptr<Folder> dir){
-	if(dir->mParent.lock() != nullptr){
-		folderStream.writeUInt32(dataStream.tell() + folderStream.getSize()); // offset to dir data
-		if(dir->mFiles.size() != 0){
-			std::cout << "writing file start ID of " << dir->mFiles[0]->GetID() << std::endl;
-			folderStream.writeUInt16(dir->mFiles[0]->GetID());
-		} else {
-			folderStream.writeUInt16(0);
-		}
-		folderStream.writeUInt16(dir->mParent.lock()->mID | 0xF000);//dir->mParent.lock()->mID); // what???
-	} else {
-		folderStream.writeUInt32(folderStream.getSize());
-		folderStream.writeUInt16(0);
-		folderStream.writeUInt16((folderStream.getSize() / 0x08) + 1);
+namespace {
+	void PutU16(std::vector<uint8_t>& out, uint16_t v){ out.push_back(v & 0xFF); out.push_back(v >> 8); }
+	void PutU32(std::vector<uint8_t>& out, uint32_t v){ PutU16(out, v & 0xFFFF); PutU16(out, v >> 16); }
+	void PatchU16(std::vector<uint8_t>& out, std::size_t at, uint16_t v){ out[at] = v & 0xFF; out[at + 1] = v >> 8; }
+	void PatchU32(std::vector<uint8_t>& out, std::size_t at, uint32_t v){ PatchU16(out, at, v & 0xFFFF); PatchU16(out, at + 2, v >> 16); }
+	uint32_t GetU32(std::vector<uint8_t>& out, std::size_t at){ return out[at] | (out[at + 1] << 8) | (out[at + 2] << 16) | (out[at + 3] << 24); }
+}
+
+// Folders and files are numbered in pre-order as they're reached. A subfolder's ID isn't known
+// when its parent's sub-table is written, so its entry is patched once the walk gets to it.
+void FileSystem::WriteDirectory(const std::shared_ptr<Folder>& dir, uint16_t parentID, std::size_t idField, FileTables& tables, std::vector<uint8_t>& subTables){
+	uint16_t id = tables.folderCount++;
+	if(tables.renumber){
+		dir->mID = id;
 	}
+	if(id != 0){
+		PatchU16(subTables, idField, id | 0xF000);
+	}
+
+	// main table entry, the offset is relative to the sub-tables until the main table's size is known
+	PutU32(tables.fnt, subTables.size());
+	PutU16(tables.fnt, tables.firstID + tables.files.size());
+	PutU16(tables.fnt, id == 0 ? 0 : parentID | 0xF000);
 
-	for (std::size_t d = 0; d < dir->mFolders.size(); d++){
-		uint8_t nameLen = dir->mFolders[d]->mName.size() | 0x80;
-		dataStream.writeUInt8(nameLen);
-		dataStream.writeString(dir->mFolders[d]->mName);
-		dataStream.writeUInt16(dir->mFolders[d]->mID | 0xF000); // offset
+	std::size_t firstChild = subTables.size();
+	for(const auto& folder : dir->mFolders){
+		subTables.push_back(folder->mName.size() | 0x80);
+		subTables.insert(subTables.end(), folder->mName.begin(), folder->mName.end());
+		PutU16(subTables, 0);
 	}
 
-	for (std::size_t f = 0; f < dir->mFiles.size(); f++){
-		uint8_t nameLen = dir->mFiles[f]->GetName().size();
-		dataStream.writeUInt8(nameLen);
-		dataStream.writeString(dir->mFiles[f]->GetName());
+	for(const auto& file : dir->mFiles){
+		std::string name = file->GetName();
+		subTables.push_back(name.size());
+		subTables.insert(subTables.end(), name.begin(), name.end());
+		if(tables.renumber){
+			file->SetID(tables.firstID + tables.files.size());
+		}
+		tables.files.push_back(file);
 	}
+	subTables.push_back(0);
 
-	dataStream.writeUInt8(0);
+	std::size_t entry = firstChild;
+	for(const auto& folder : dir->mFolders){
+		entry += 1 + folder->mName.size();
+		WriteDirectory(folder, id, entry, tables, subTables);
+		entry += 2;
+	}
 }
 
+void FileSystem::WriteTables(FileTables& tables, uint16_t firstID){
+	tables.fnt.clear();
+	tables.files.clear();
+	tables.firstID = firstID;
+	tables.folderCount = 0;
+
+	if(!mHasFNT || mRoot == nullptr){
+		// one dummy entry for a 'root' dir w/ all files
+		PutU32(tables.fnt, 0x00000004);
+		PutU32(tables.fnt, 0x00010000);
+		tables.folderCount = 1;
+		for(const auto& file : mFiles){
+			if(tables.renumber){
+				file->SetID(firstID + tables.files.size());
+			}
+			tables.files.push_back(file);
+		}
+	} else {
+		std::vector<uint8_t> subTables;
+		WriteDirectory(mRoot, 0, 0, tables, subTables);
 
-uint32_t FileSystem::CalculateFNTSize(){
-	uint32_t fntSize = 0;
+		uint32_t mainTableSize = tables.fnt.size();
+		for(std::size_t entry = 0; entry < mainTableSize; entry += 8){
+			PatchU32(tables.fnt, entry, GetU32(tables.fnt, entry) + mainTableSize);
+		}
+		PatchU16(tables.fnt, 6, tables.folderCount);
+		tables.fnt.insert(tables.fnt.end(), subTables.begin(), subTables.end());
+	}
 
-	if(!mHasFNT){
+	if(!tables.renumber){
+		return;
+	}
+
+	if(mIndex == nullptr){
+		Reindex();
+	}
+	mIndex->ids.resize(firstID);
+	mIndex->ids.insert(mIndex->ids.end(), tables.files.begin(), tables.files.end());
+}
+
+uint32_t FileSystem::CalculateFNTSize(){
+	if(!mHasFNT || mRoot == nullptr){
 		return 0x08;
 	}
 
-	Traverse(
-		[&](std::shared_ptr<Folder> f){
-			//0x08 - size of folder table entry
-			//0x03 - size of subdir entry
-			fntSize += 0x08 + 0x03 + f->GetName().size() + 0x01;
+	//0x08 - size of folder table entry, 0x01 - sub-table terminator
+	//0x03 - size of subdir entry, minus the name
+	uint32_t fntSize = 0;
+	Visit(
+		[&](const std::shared_ptr<Folder>& f){
+			fntSize += 0x09 + (f == mRoot ? 0 : 0x03 + f->mName.size());
 		},
-		[&](std::shared_ptr<File> f){
+		[&](const std::shared_ptr<File>& f){
 			fntSize += 0x01 + f->GetName().size();
 		}
 	);
@@ -237,76 +594,73 @@ uint32_t FileSystem::CalculateFNTSize(){
 }
 
 void FileSystem::WriteFNT(bStream::CStream& strm){
-	if(!mHasFNT){ // Write one dummy entry for a 'root' dir w/ all files
-		strm.writeUInt32(0x00000004);
-		strm.writeUInt32(0x00010000);
-		return;
-	}
-
-
-	uint32_t dataSize = 0;
-	uint32_t headerSize = 0;
-	uint32_t idx = 0;
-	uint32_t fileIdx = 0;
-	std::vector<std::shared_ptr<Folder>> flatFolders;
-	Traverse(
-		[&](std::shared_ptr<Folder> f){
-			f->mID = idx++;
-			flatFolders.push_back(f);
-			headerSize += 0x08;
-			dataSize += 0x03 + f->GetName().size() + 0x01;
-		},
-		[&](std::shared_ptr<File> f){
-			f->SetID(fileIdx++);
-			dataSize += 0x01 + f->GetName().size();
-		}
-	);
-
-	uint8_t* folderHeaders = new uint8_t[headerSize]{0};
-	uint8_t* folderData = new uint8_t[dataSize]{0};
-
-	bStream::CMemoryStream folderStream(folderHeaders, headerSize, bStream::Endianess::Little, bStream::OpenMode::Out);
-	bStream::CMemoryStream dataStream(folderData, dataSize, bStream::Endianess::Little, bStream::OpenMode::Out);
-
-
-	for(auto f : flatFolders){
-		WriteDirectory(folderStream, dataStream, f);
-	}
-	
-	strm.writeBytes(folderHeaders, headerSize);
-	strm.writeBytes(folderData, dataSize);
-
-	delete[] folderHeaders;
-	delete[] folderData;
+	FileTables tables;
+	WriteTables(tables);
+	strm.writeBytes(tables.fnt.data(), tables.fnt.size());
 }
 
 uint32_t FileSystem::CalculateFATSize(){
 	uint32_t fatSize = 0;
 
-	ForEachFile([&](std::shared_ptr<File> f){
+	for([[maybe_unused]] const auto& f : Files()){
 		fatSize += 8;
-	});
+	}
 
 	return fatSize;
 }
 
 void FileSystem::WriteFAT(bStream::CStream& strm){
-	uint32_t fatOffset = 0x00;
+	// numbered like WriteFNT, offsets as Archive::SaveArchive lays the files out
+	FileTables tables;
+	WriteTables(tables);
+
+	uint32_t imageSize = 0;
+	for(const FileSlot& slot : LayoutFiles(tables.files, 32, false, imageSize)){
+		strm.writeUInt32(slot.start);
+		strm.writeUInt32(slot.end);
+	}
+}
 
-	std::vector<std::shared_ptr<File>> files = {};
+std::vector<FileSlot> FileSystem::LayoutFiles(std::vector<std::shared_ptr<File>>& files, uint32_t alignment, bool deduplicate, uint32_t& imageSize){
+	std::vector<FileSlot> slots(files.size());
+
+	// only files sharing a size with another can be duplicates, so only those get hashed
+	std::unordered_map<uint32_t, uint32_t> sizeCounts;
+	if(deduplicate){
+		for(auto& file : files){
+			sizeCounts[file->GetSize()]++;
+		}
+	}
 
-	ForEachFile([&](std::shared_ptr<File> f){
-		files.push_back(f);
-	});
-	
-	std::sort(files.begin(), files.end(), [](std::shared_ptr<File> a, std::shared_ptr<File> b){ return a->GetID() < b->GetID(); });
+	std::unordered_multimap<uint64_t, std::size_t> placed;
+	uint32_t cursor = 0;
 
 	for(std::size_t i = 0; i < files.size(); i++){
-		strm.writeUInt32(fatOffset);
-		strm.writeUInt32(fatOffset + PadTo32(files[i]->GetSize()));
-		fatOffset += PadTo32(files[i]->GetSize());
+		uint32_t size = files[i]->GetSize();
+
+		if(deduplicate && size > 0 && sizeCounts[size] > 1){
+			uint64_t hash = files[i]->GetHash();
+			auto [first, last] = placed.equal_range(hash);
+			for(auto it = first; it != last; it++){
+				if(files[it->second]->ContentEquals(files[i])){
+					slots[i] = { slots[it->second].start, slots[it->second].end, true };
+					break;
+				}
+			}
+
+			if(slots[i].duplicate){
+				continue;
+			}
+			placed.insert({hash, i});
+		}
+
+		cursor += Pad(cursor, alignment);
+		slots[i] = { cursor, cursor + size, false };
+		cursor += size;
 	}
 
+	imageSize = cursor;
+	return slots;
 }
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,295 @@
+#include "NDS/System/FlatFileSystem.hpp"
+#include <iostream>
+#include <algorithm>
+#include <memory>
+
+namespace Palkia::Nitro {
+
+namespace {
+	// calls onPart for every non empty "/" separated component, stops early if it returns false
+	template<typename OnPart>
+	bool SplitPath(std::string_view path, OnPart&& onPart){
+		while(!path.empty()){
+			std::size_t end = path.find('/');
+			std::string_view part = path.substr(0, end);
+			if(!part.empty() && !onPart(part, end == std::string_view::npos || path.find_first_not_of('/', end) == std::string_view::npos)){
+				return false;
+			}
+			if(end == std::string_view::npos) break;
+			path.remove_prefix(end + 1);
+		}
+		return true;
+	}
+}
+
+bool FlatFileSystem::ParseFNT(bStream::CStream& strm, uint32_t fntSize){
+	if(fntSize < 8){
+		std::cout << "FNT too small" << std::endl;
+		return false;
+	}
+
+	std::unique_ptr<uint8_t[]> fnt = std::make_unique_for_overwrite<uint8_t[]>(fntSize);
+	strm.readBytesTo(fnt.get(), fntSize);
+
+	auto u16 = [&](uint32_t offset) -> uint16_t { return fnt[offset] | (fnt[offset + 1] << 8); };
+	auto u32 = [&](uint32_t offset) -> uint32_t { return u16(offset) | (u16(offset + 2) << 16); };
+
+	// the root's sub-table comes right after the main table, which is more trustworthy than
+	// the folder count next to it (older Palkia builds wrote that one off by one)
+	uint32_t folderCount = u32(0) / 8;
+	if(folderCount == 0 || folderCount > 0x1000 || folderCount * 8 > fntSize){
+		folderCount = 1; // dummy FNT, one root with every file
+	}
+
+	mFolderParent.assign(folderCount, None);
+	mFolderFirstFile.resize(folderCount);
+	mFolderFileCount.assign(folderCount, 0);
+	mFolderFirstChild.resize(folderCount);
+	mFolderChildCount.assign(folderCount, 0);
+	mFolderName.assign(folderCount, { 0, 0 });
+
+	// first pass sizes every table so the second can fill them without growing anything
+	uint32_t nameBytes = 0;
+	uint32_t childCount = 0;
+	uint32_t fileCount = 0;
+	for(uint16_t folder = 0; folder < folderCount; folder++){
+		uint32_t cursor = u32(folder * 8);
+		mFolderFirstFile[folder] = u16(folder * 8 + 4);
+
+		while(true){
+			if(cursor >= fntSize){
+				std::cout << "FNT sub-table " << folder << " runs past the end" << std::endl;
+				return false;
+			}
+
+			uint8_t type = fnt[cursor++];
+			if(type == 0) break;
+
+			uint8_t nameLen = type & 0x7F;
+			nameBytes += nameLen;
+			cursor += nameLen;
+
+			if(type & 0x80){
+				if(cursor + 2 > fntSize){
+					std::cout << "FNT sub-table " << folder << " runs past the end" << std::endl;
+					return false;
+				}
+				uint16_t child = u16(cursor) & 0x0FFF;
+				if(child == 0 || child >= folderCount){
+					std::cout << "FNT folder " << folder << " names bad subfolder " << child << std::endl;
+					return false;
+				}
+				cursor += 2;
+				mFolderChildCount[folder]++;
+			} else {
+				mFolderFileCount[folder]++;
+			}
+		}
+
+		// None is never a file ID, and the cursor below mustn't wrap
+		if(mFolderFirstFile[folder] + mFolderFileCount[folder] > None){
+			std::cout << "FNT folder " << folder << " has files past ID " << None - 1 << std::endl;
+			return false;
+		}
+
+		mFolderFirstChild[folder] = childCount;
+		childCount += mFolderChildCount[folder];
+		fileCount = std::max<uint32_t>(fileCount, mFolderFirstFile[folder] + mFolderFileCount[folder]);
+	}
+
+	mChildren.resize(childCount);
+	mChildSlot.resize(childCount);
+	mNames.clear();
+	mNames.reserve(nameBytes);
+	if(fileCount > mFileFolder.size()){
+		mFileFolder.resize(fileCount);
+		mFileStart.resize(fileCount);
+		mFileEnd.resize(fileCount);
+	}
+	mFileFolder.assign(mFileFolder.size(), None);
+	mFileName.assign(mFileFolder.size(), { 0, 0 });
+
+	for(uint16_t folder = 0; folder < folderCount; folder++){
+		uint32_t cursor = u32(folder * 8);
+		uint32_t child = mFolderFirstChild[folder];
+		uint16_t file = mFolderFirstFile[folder];
+
+		while(uint8_t type = fnt[cursor++]){
+			uint8_t nameLen = type & 0x7F;
+			Name name { static_cast<uint32_t>(mNames.size()), nameLen };
+			mNames.append(reinterpret_cast<char*>(fnt.get()) + cursor, nameLen);
+			cursor += nameLen;
+
+			if(type & 0x80){
+				uint16_t id = u16(cursor) & 0x0FFF;
+				cursor += 2;
+				if(mFolderParent[id] != None){
+					std::cout << "FNT folder " << id << " is listed in more than one folder" << std::endl;
+					return false;
+				}
+				mChildSlot[child] = file - mFolderFirstFile[folder];
+				mChildren[child++] = id;
+				mFolderParent[id] = folder;
+				mFolderName[id] = name;
+			} else {
+				if(mFileFolder[file] != None){
+					std::cout << "FNT file " << file << " is listed in more than one folder" << std::endl;
+					return false;
+				}
+				mFileFolder[file] = folder;
+				mFileName[file] = name;
+				file++;
+			}
+		}
+	}
+
+	for(uint16_t folder = 1; folder < folderCount; folder++){
+		if(mFolderParent[folder] == None){
+			std::cout << "FNT folder " << folder << " isn't in any folder" << std::endl;
+			return false;
+		}
+	}
+
+	// every parent chain has to end, GetFolderPath and friends walk them. 1 is on the chain
+	// being followed, 2 is known to end.
+	std::vector<uint8_t> state(folderCount, 0);
+	std::vector<uint16_t> chain;
+	for(uint16_t folder = 0; folder < folderCount; folder++){
+		chain.clear();
+		for(uint16_t up = folder; up != None && state[up] != 2; up = mFolderParent[up]){
+			if(state[up] == 1){
+				std::cout << "FNT folder " << up << " is inside itself" << std::endl;
+				return false;
+			}
+			state[up] = 1;
+			chain.push_back(up);
+		}
+		for(uint16_t up : chain){
+			state[up] = 2;
+		}
+	}
+
+	return true;
+}
+
+void FlatFileSystem::ParseFAT(bStream::CStream& strm, uint32_t entryCount){
+	if(entryCount > mFileFolder.size()){
+		mFileFolder.resize(entryCount, None);
+		mFileName.resize(entryCount, { 0, 0 });
+	}
+	mFileStart.resize(mFileFolder.size());
+	mFileEnd.resize(mFileFolder.size());
+
+	for(uint32_t file = 0; file < entryCount; file++){
+		mFileStart[file] = strm.readUInt32();
+		mFileEnd[file] = strm.readUInt32();
+	}
+}
+
+uint32_t FlatFileSystem::CalculateFNTSize() const {
+	// every folder is a main table entry plus a terminator, every name is a length byte, and
+	// every subfolder also has its ID
+	return mFolderParent.size() * 0x09 + mChildren.size() * 0x03 + (mFileFolder.size() - std::ranges::count(mFileFolder, None)) + mNames.size();
+}
+
+void FlatFileSystem::WriteFNT(bStream::CStream& strm) const {
+	uint32_t offset = mFolderParent.size() * 0x08;
+	for(uint16_t folder = 0; folder < mFolderParent.size(); folder++){
+		strm.writeUInt32(offset);
+		strm.writeUInt16(mFolderFirstFile[folder]);
+		strm.writeUInt16(folder == 0 ? mFolderParent.size() : mFolderParent[folder] | 0xF000);
+
+		offset += 0x01;
+		for(uint16_t child : GetSubfolders(folder)){
+			offset += 0x03 + mFolderName[child].length;
+		}
+		for(uint16_t file : GetFiles(folder)){
+			offset += 0x01 + mFileName[file].length;
+		}
+	}
+
+	for(uint16_t folder = 0; folder < mFolderParent.size(); folder++){
+		uint16_t file = mFolderFirstFile[folder];
+		auto writeFiles = [&](uint16_t until){
+			for(; file < until; file++){
+				strm.writeUInt8(mFileName[file].length);
+				strm.writeString(std::string(GetFileName(file)));
+			}
+		};
+
+		for(uint32_t child = mFolderFirstChild[folder]; child < mFolderFirstChild[folder] + mFolderChildCount[folder]; child++){
+			writeFiles(mFolderFirstFile[folder] + mChildSlot[child]);
+			strm.writeUInt8(mFolderName[mChildren[child]].length | 0x80);
+			strm.writeString(std::string(GetFolderName(mChildren[child])));
+			strm.writeUInt16(mChildren[child] | 0xF000);
+		}
+		writeFiles(mFolderFirstFile[folder] + mFolderFileCount[folder]);
+		strm.writeUInt8(0);
+	}
+}
+
+void FlatFileSystem::WriteFAT(bStream::CStream& strm) const {
+	for(std::size_t file = 0; file < mFileStart.size(); file++){
+		strm.writeUInt32(mFileStart[file]);
+		strm.writeUInt32(mFileEnd[file]);
+	}
+}
+
+std::string FlatFileSystem::GetFolderPath(uint16_t folder) const {
+	std::string path;
+	for(; folder != 0 && folder != None; folder = mFolderParent[folder]){
+		path = path.empty() ? std::string(GetFolderName(folder)) : std::string(GetFolderName(folder)) + "/" + path;
+	}
+	return path;
+}
+
+std::string FlatFileSystem::GetFilePath(uint16_t file) const {
+	if(mFileFolder[file] == None) return "";
+	std::string dir = GetFolderPath(mFileFolder[file]);
+	return dir.empty() ? std::string(GetFileName(file)) : dir + "/" + std::string(GetFileName(file));
+}
+
+uint16_t FlatFileSystem::FindChild(uint16_t folder, std::string_view name) const {
+	for(uint16_t child : GetSubfolders(folder)){
+		if(GetFolderName(child) == name) return child;
+	}
+	return None;
+}
+
+uint16_t FlatFileSystem::FindFolder(std::filesystem::path path) const {
+	if(mFolderParent.empty()) return None;
+
+	uint16_t folder = 0;
+	std::string key = path.generic_string();
+	SplitPath(key, [&](std::string_view part, bool){
+		folder = FindChild(folder, part);
+		return folder != None;
+	});
+
+	return folder;
+}
+
+uint16_t FlatFileSystem::FindFile(std::filesystem::path path) const {
+	if(mFolderParent.empty()) return None;
+
+	uint16_t folder = 0;
+	uint16_t found = None;
+	std::string key = path.generic_string();
+	SplitPath(key, [&](std::string_view part, bool last){
+		if(!last){
+			folder = FindChild(folder, part);
+			return folder != None;
+		}
+		for(uint16_t file : GetFiles(folder)){
+			if(GetFileName(file) == part){
+				found = file;
+				break;
+			}
+		}
+		return false;
+	});
+
+	return found;
+}
+
+}
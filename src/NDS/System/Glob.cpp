@@ -0,0 +1,214 @@
+#include "NDS/System/Glob.hpp"
+#include <algorithm>
+
+namespace Palkia::Nitro {
+
+namespace {
+	void AddState(std::vector<uint16_t>& states, uint16_t state){
+		if(std::find(states.begin(), states.end(), state) == states.end()){
+			states.push_back(state);
+		}
+	}
+}
+
+Glob::Glob(std::string_view pattern){
+	// no slash at all means the name can be anywhere
+	if(pattern.find('/') == std::string_view::npos){
+		mComponents.push_back({ .globstar = true, .literal = false });
+	}
+
+	while(!pattern.empty()){
+		std::size_t end = pattern.find('/');
+		std::string_view part = pattern.substr(0, end);
+		pattern.remove_prefix(end == std::string_view::npos ? pattern.size() : end + 1);
+
+		if(part.empty()){
+			continue;
+		}
+
+		Component component;
+		if(part == "**"){
+			component.globstar = true;
+			component.literal = false;
+			mComponents.push_back(component);
+			continue;
+		}
+
+		auto literal = [&](char c){
+			if(component.tokens.empty() || component.tokens.back().kind != Token::Kind::Literal){
+				component.tokens.push_back({ Token::Kind::Literal });
+			}
+			component.tokens.back().literal.push_back(c);
+		};
+
+		for(std::size_t i = 0; i < part.size(); i++){
+			char c = part[i];
+			if(c == '\\' && i + 1 < part.size()){
+				literal(part[++i]);
+			} else if(c == '*'){
+				if(component.tokens.empty() || component.tokens.back().kind != Token::Kind::Star){
+					component.tokens.push_back({ Token::Kind::Star });
+				}
+			} else if(c == '?'){
+				component.tokens.push_back({ Token::Kind::One });
+			} else if(c == '[' && part.find(']', i + 2) != std::string_view::npos){
+				Token token { Token::Kind::Class };
+				bool negate = part[i + 1] == '!' || part[i + 1] == '^';
+				std::size_t j = i + (negate ? 2 : 1);
+
+				// a ']' straight after the opening bracket is part of the class
+				for(bool first = true; j < part.size() && (first || part[j] != ']'); j++, first = false){
+					uint8_t from = part[j];
+					if(j + 2 < part.size() && part[j + 1] == '-' && part[j + 2] != ']'){
+						for(uint32_t ch = from; ch <= static_cast<uint8_t>(part[j + 2]); ch++){
+							token.set.set(ch);
+						}
+						j += 2;
+					} else {
+						token.set.set(from);
+					}
+				}
+
+				if(j >= part.size()){
+					literal(c); // never closed, take it literally
+					continue;
+				}
+
+				if(negate){
+					token.set.flip();
+				}
+				component.tokens.push_back(token);
+				i = j;
+			} else {
+				literal(c);
+			}
+		}
+
+		component.literal = component.tokens.size() == 1 && component.tokens[0].kind == Token::Kind::Literal;
+		if(component.literal){
+			component.text = component.tokens[0].literal;
+		}
+		mComponents.push_back(component);
+	}
+}
+
+bool Glob::MatchComponent(const Component& component, std::string_view name) const {
+	if(component.literal){
+		return name == component.text;
+	}
+
+	// every token but Star has a fixed width, so backtracking to the last star is enough
+	const std::vector<Token>& tokens = component.tokens;
+	std::size_t t = 0, n = 0;
+	std::size_t star = std::string_view::npos, resume = 0;
+
+	while(n < name.size()){
+		if(t < tokens.size()){
+			const Token& token = tokens[t];
+			if(token.kind == Token::Kind::Star){
+				star = t++;
+				resume = n;
+				continue;
+			}
+			if(token.kind == Token::Kind::Literal && name.substr(n).starts_with(token.literal)){
+				t++;
+				n += token.literal.size();
+				continue;
+			}
+			if(token.kind == Token::Kind::One || (token.kind == Token::Kind::Class && token.set.test(static_cast<uint8_t>(name[n])))){
+				t++;
+				n++;
+				continue;
+			}
+		}
+
+		if(star == std::string_view::npos){
+			return false;
+		}
+		t = star + 1;
+		n = ++resume;
+	}
+
+	while(t < tokens.size() && tokens[t].kind == Token::Kind::Star){
+		t++;
+	}
+	return t == tokens.size();
+}
+
+void Glob::Close(std::vector<uint16_t>& states) const {
+	// a ** can also match no folders at all, so whatever follows it is live too
+	for(std::size_t i = 0; i < states.size(); i++){
+		if(states[i] < mComponents.size() && mComponents[states[i]].globstar){
+			AddState(states, states[i] + 1);
+		}
+	}
+}
+
+std::vector<uint16_t> Glob::Start() const {
+	std::vector<uint16_t> states;
+	if(!mComponents.empty()){
+		states.push_back(0);
+		Close(states);
+	}
+	return states;
+}
+
+void Glob::Enter(const std::vector<uint16_t>& states, std::string_view folder, std::vector<uint16_t>& next) const {
+	next.clear();
+	for(uint16_t state : states){
+		if(state >= mComponents.size()){
+			continue;
+		}
+
+		const Component& component = mComponents[state];
+		if(component.globstar){
+			AddState(next, state);
+		} else if(state + 1u < mComponents.size() && MatchComponent(component, folder)){
+			AddState(next, state + 1);
+		}
+	}
+	Close(next);
+}
+
+bool Glob::MatchFile(const std::vector<uint16_t>& states, std::string_view name) const {
+	for(uint16_t state : states){
+		if(state + 1u != mComponents.size()){
+			continue;
+		}
+
+		const Component& component = mComponents[state];
+		if(component.globstar || MatchComponent(component, name)){
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool Glob::Match(std::string_view path) const {
+	std::vector<uint16_t> states = Start();
+	std::vector<uint16_t> next;
+
+	while(!path.empty() && path.front() == '/'){
+		path.remove_prefix(1);
+	}
+
+	std::size_t end;
+	while((end = path.find('/')) != std::string_view::npos){
+		std::string_view folder = path.substr(0, end);
+		path.remove_prefix(end + 1);
+		if(folder.empty()){
+			continue;
+		}
+
+		Enter(states, folder, next);
+		std::swap(states, next);
+		if(states.empty()){
+			return false;
+		}
+	}
+
+	return MatchFile(states, path);
+}
+
+}
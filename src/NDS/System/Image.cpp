@@ -0,0 +1,204 @@
+#include "NDS/System/Image.hpp"
+#include <bstream/bstream.h>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Palkia::Nitro {
+
+std::shared_ptr<Image> Image::Map(std::filesystem::path path){
+	if(!std::filesystem::exists(path)){
+		return nullptr;
+	}
+
+	std::shared_ptr<Image> image = std::make_shared<Image>();
+
+#ifndef _WIN32
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0){
+		return nullptr;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0){
+		close(fd);
+		return nullptr;
+	}
+
+	// MAP_PRIVATE so pages are only copied once something actually writes to them
+	void* mapping = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+	if(mapping == MAP_FAILED){
+		close(fd);
+		return nullptr;
+	}
+
+	image->mFd = fd;
+
+	image->mData = static_cast<uint8_t*>(mapping);
+	image->mSize = st.st_size;
+	image->mMapped = true;
+#else
+	// no mmap here, just pull the whole image in once
+	bStream::CFileStream file(path.string(), bStream::Endianess::Little, bStream::OpenMode::In);
+	image->mSize = file.getSize();
+	image->mData = new uint8_t[image->mSize];
+	file.readBytesTo(image->mData, image->mSize);
+#endif
+
+	return image;
+}
+
+std::shared_ptr<Image> Image::Open(std::filesystem::path path){
+#ifndef _WIN32
+	if(!std::filesystem::exists(path)){
+		return nullptr;
+	}
+
+	std::shared_ptr<Image> image = std::make_shared<Image>();
+
+	image->mFd = open(path.c_str(), O_RDONLY);
+	if(image->mFd < 0){
+		return nullptr;
+	}
+
+	struct stat st;
+	if(fstat(image->mFd, &st) != 0){
+		return nullptr;
+	}
+	image->mSize = st.st_size;
+
+	return image;
+#else
+	return Map(path);
+#endif
+}
+
+bool Image::Read(std::size_t offset, uint8_t* dst, std::size_t size){
+	if(offset > mSize || size > mSize - offset){
+		return false;
+	}
+
+	if(mData != nullptr){
+		memcpy(dst, mData + offset, size);
+		return true;
+	}
+
+#ifndef _WIN32
+	while(size > 0){
+		ssize_t r = pread(mFd, dst, size, offset);
+		if(r <= 0){
+			return false;
+		}
+		dst += r;
+		offset += r;
+		size -= r;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool Image::IsFile(std::filesystem::path path){
+#ifndef _WIN32
+	struct stat image, other;
+	return mFd >= 0 && fstat(mFd, &image) == 0 && stat(path.c_str(), &other) == 0 && image.st_dev == other.st_dev && image.st_ino == other.st_ino;
+#else
+	return false; // read into memory whole, nothing goes back to the file
+#endif
+}
+
+Image::~Image(){
+#ifndef _WIN32
+	if(mFd >= 0){
+		close(mFd);
+	}
+#endif
+
+	if(mData == nullptr){
+		return;
+	}
+
+#ifndef _WIN32
+	if(mMapped){
+		munmap(mData, mSize);
+		return;
+	}
+#endif
+
+	delete[] mData;
+}
+
+bool ImageWriter::Open(std::filesystem::path path, std::size_t size){
+#ifndef _WIN32
+	mFd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(mFd < 0){
+		return false;
+	}
+	return ftruncate(mFd, size) == 0;
+#else
+	mStream.open(path, std::ios::binary | std::ios::out | std::ios::trunc);
+	return mStream.is_open();
+#endif
+}
+
+bool ImageWriter::Open(std::filesystem::path path){
+#ifndef _WIN32
+	mFd = open(path.c_str(), O_WRONLY);
+	return mFd >= 0;
+#else
+	mStream.open(path, std::ios::binary | std::ios::in | std::ios::out);
+	return mStream.is_open();
+#endif
+}
+
+bool ImageWriter::Write(std::size_t offset, const uint8_t* data, std::size_t size){
+#ifndef _WIN32
+	while(size > 0){
+		ssize_t w = pwrite(mFd, data, size, offset);
+		if(w <= 0){
+			return false;
+		}
+		data += w;
+		offset += w;
+		size -= w;
+	}
+	return true;
+#else
+	std::lock_guard<std::mutex> lock(mLock);
+	mStream.seekp(offset);
+	mStream.write(reinterpret_cast<const char*>(data), size);
+	return mStream.good();
+#endif
+}
+
+bool ImageWriter::Fill(std::size_t offset, std::size_t size, uint8_t value){
+	uint8_t block[0x400];
+	memset(block, value, sizeof(block));
+
+	while(size > 0){
+		std::size_t chunk = size < sizeof(block) ? size : sizeof(block);
+		if(!Write(offset, block, chunk)){
+			return false;
+		}
+		offset += chunk;
+		size -= chunk;
+	}
+	return true;
+}
+
+ImageWriter::~ImageWriter(){
+#ifndef _WIN32
+	if(mFd >= 0){
+		close(mFd);
+	}
+#endif
+}
+
+}
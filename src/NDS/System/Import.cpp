@@ -0,0 +1,247 @@
+#include "NDS/System/FileSystem.hpp"
+#include "NDS/System/Manifest.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <unordered_map>
+#include <iostream>
+#include <fstream>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <mutex>
+
+namespace Palkia::Nitro {
+
+namespace {
+	// below this a read is cheaper than setting up a mapping
+	constexpr std::uintmax_t MapThreshold = 1 << 20;
+
+	struct PendingFolder {
+		std::shared_ptr<Folder> folder;
+		std::filesystem::path path;
+		std::string relative;
+	};
+
+	struct PendingFile {
+		std::filesystem::path path;
+		std::string relative;
+		std::shared_ptr<File>* slot; // in the parent's file list, sized before any loads start
+	};
+}
+
+std::shared_ptr<File> File::Import(std::filesystem::path path){
+	std::error_code err;
+	std::uintmax_t size = std::filesystem::file_size(path, err);
+	if(err || size > UINT32_MAX){
+		return nullptr;
+	}
+
+	std::shared_ptr<File> f;
+	if(size >= MapThreshold){
+		if(std::shared_ptr<Image> image = Image::Map(path)){
+			f = Map(image, 0, 0, image->GetSize());
+		}
+	}
+
+	if(f == nullptr){
+		std::ifstream in(path, std::ios::binary);
+		if(!in){
+			return nullptr;
+		}
+
+		std::shared_ptr<uint8_t[]> buffer = std::make_shared_for_overwrite<uint8_t[]>(size);
+		if(!in.read(reinterpret_cast<char*>(buffer.get()), size)){
+			return nullptr;
+		}
+
+		f = std::make_shared<File>();
+		f->mData = buffer.get();
+		f->mSize = size;
+		f->mStorage = buffer;
+		f->mOwnsData = true;
+	}
+
+	f->mName = path.filename().string();
+	return f;
+}
+
+bool FileSystem::Import(std::filesystem::path path, uint32_t threads){
+	if(!std::filesystem::is_directory(path)){
+		std::cout << path << " isn't a directory" << std::endl;
+		return false;
+	}
+
+	if(threads == 0){
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	std::shared_ptr<Folder> root = std::make_shared<Folder>();
+
+	// Listing, every worker takes a folder, reads its entries and queues the subfolders it found
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<PendingFolder> folders = { { root, path, "" } };
+	std::vector<PendingFile> files;
+	uint32_t busy = 0;
+	bool ok = true;
+
+	auto list = [&](){
+		std::unique_lock<std::mutex> guard(lock);
+		while(true){
+			wake.wait(guard, [&](){ return !folders.empty() || busy == 0; });
+			if(folders.empty()){
+				return;
+			}
+
+			PendingFolder dir = std::move(folders.front());
+			folders.pop_front();
+			busy++;
+			guard.unlock();
+
+			std::vector<PendingFolder> foundFolders;
+			std::vector<std::pair<std::filesystem::path, std::string>> foundFiles;
+			std::error_code err;
+			for(auto& entry : std::filesystem::directory_iterator(dir.path, err)){
+				std::string name = entry.path().filename().string();
+				if(name.size() > 0x7F){
+					std::cout << "Skipping " << entry.path() << ", names are limited to 127 characters" << std::endl;
+					continue;
+				}
+
+				std::string relative = PathIndex::Join(dir.relative, name);
+				if(entry.is_directory()){
+					std::shared_ptr<Folder> folder = std::make_shared<Folder>();
+					folder->mName = name;
+					folder->mParent = dir.folder;
+					dir.folder->mFolders.push_back(folder);
+					foundFolders.push_back({ folder, entry.path(), relative });
+				} else if(entry.is_regular_file() && !(dir.folder == root && name == Manifest::FileName)){
+					foundFiles.push_back({ entry.path(), relative });
+				}
+			}
+
+			// only this worker touches dir.folder, so the slots can be handed out before loading
+			dir.folder->mFiles.resize(foundFiles.size());
+
+			guard.lock();
+			if(err){
+				std::cout << "Couldn't list " << dir.path << ": " << err.message() << std::endl;
+				ok = false;
+			}
+			for(std::size_t i = 0; i < foundFiles.size(); i++){
+				files.push_back({ std::move(foundFiles[i].first), std::move(foundFiles[i].second), &dir.folder->mFiles[i] });
+			}
+			for(auto& folder : foundFolders){
+				folders.push_back(std::move(folder));
+			}
+			busy--;
+			wake.notify_all();
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for(uint32_t t = 1; t < threads; t++){
+		workers.emplace_back(list);
+	}
+	list();
+	for(auto& worker : workers){
+		worker.join();
+	}
+	workers.clear();
+
+	if(!ok){
+		return false;
+	}
+
+	// Loading, every file is independent now
+	std::atomic<std::size_t> next { 0 };
+	std::atomic<bool> loaded { true };
+	auto load = [&](){
+		for(std::size_t i = next++; i < files.size(); i = next++){
+			*files[i].slot = File::Import(files[i].path);
+			if(*files[i].slot == nullptr){
+				std::cout << "Couldn't read " << files[i].path << std::endl;
+				loaded = false;
+			}
+		}
+	};
+
+	for(uint32_t t = 1; t < threads && t < files.size(); t++){
+		workers.emplace_back(load);
+	}
+	load();
+	for(auto& worker : workers){
+		worker.join();
+	}
+
+	if(!loaded){
+		return false;
+	}
+
+	// Ordering, pre-order numbering gives back the dumped IDs once every folder lists its
+	// files by ID and its subfolders by the lowest ID below them. New files go last, by name.
+	std::unordered_map<std::string, uint32_t> ids;
+	uint32_t lowestID = UINT32_MAX;
+	Manifest manifest;
+	if(manifest.Load(path / Manifest::FileName)){
+		for(auto& entry : manifest.GetEntries()){
+			ids[entry.path] = entry.id;
+			lowestID = std::min(lowestID, entry.id);
+		}
+	}
+
+	std::unordered_map<File*, uint32_t> fileOrder;
+	for(auto& file : files){
+		auto id = ids.find(file.relative);
+		fileOrder[file.slot->get()] = id != ids.end() ? id->second : UINT32_MAX;
+	}
+
+	std::function<uint32_t(Folder&)> order = [&](Folder& dir){
+		uint32_t lowest = UINT32_MAX;
+
+		std::sort(dir.mFiles.begin(), dir.mFiles.end(), [&](const std::shared_ptr<File>& a, const std::shared_ptr<File>& b){
+			return std::tie(fileOrder[a.get()], a->GetName()) < std::tie(fileOrder[b.get()], b->GetName());
+		});
+		if(!dir.mFiles.empty()){
+			lowest = fileOrder[dir.mFiles.front().get()];
+		}
+
+		std::unordered_map<Folder*, uint32_t> folderOrder;
+		for(auto& folder : dir.mFolders){
+			folderOrder[folder.get()] = order(*folder);
+			lowest = std::min(lowest, folderOrder[folder.get()]);
+		}
+		std::sort(dir.mFolders.begin(), dir.mFolders.end(), [&](const std::shared_ptr<Folder>& a, const std::shared_ptr<Folder>& b){
+			return std::tie(folderOrder[a.get()], a->mName) < std::tie(folderOrder[b.get()], b->mName);
+		});
+
+		return lowest;
+	};
+	order(*root);
+
+	// IDs below the tree's, like a rom's overlays, stay where they are. The tree starts where
+	// the one it replaces did, or where the dumped one did.
+	uint32_t firstID = UINT32_MAX;
+	VisitFiles([&](const std::shared_ptr<File>& file){ firstID = std::min<uint32_t>(firstID, file->GetID()); });
+	if(firstID == UINT32_MAX){
+		firstID = lowestID != UINT32_MAX ? lowestID : 0;
+	}
+
+	std::shared_ptr<PathIndex> index = std::make_shared<PathIndex>();
+	root->Index(index, "");
+	if(mIndex != nullptr){
+		index->ids.assign(mIndex->ids.begin(), mIndex->ids.begin() + std::min<std::size_t>(firstID, mIndex->ids.size()));
+	}
+
+	mRoot = root;
+	mHasFNT = true;
+	mFiles.clear();
+	mIndex = index;
+
+	FileTables tables;
+	WriteTables(tables, static_cast<uint16_t>(firstID));
+
+	return true;
+}
+
+}
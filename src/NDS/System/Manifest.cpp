@@ -0,0 +1,133 @@
+#include "NDS/System/Manifest.hpp"
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <charconv>
+#include <cstdio>
+
+namespace Palkia::Nitro {
+
+namespace {
+	constexpr std::string_view Header = "palkia-manifest 2";
+	constexpr std::string_view HeaderV1 = "palkia-manifest 1";
+
+	// next tab separated field as a number, advances line past it
+	template<typename T>
+	bool Field(std::string_view& line, T& value, int base = 10){
+		std::size_t tab = line.find('\t');
+		if(tab == std::string_view::npos){
+			return false;
+		}
+
+		auto [end, err] = std::from_chars(line.data(), line.data() + tab, value, base);
+		if(err != std::errc() || end != line.data() + tab){
+			return false;
+		}
+
+		line.remove_prefix(tab + 1);
+		return true;
+	}
+}
+
+void Manifest::Reindex(){
+	mByPath.clear();
+	for(std::size_t i = 0; i < mEntries.size(); i++){
+		mByPath[mEntries[i].path] = i;
+	}
+}
+
+void Manifest::Add(Entry entry){
+	mByPath[entry.path] = mEntries.size();
+	mEntries.push_back(std::move(entry));
+}
+
+const Manifest::Entry* Manifest::Find(const std::string& path) const {
+	auto entry = mByPath.find(path);
+	return entry != mByPath.end() ? &mEntries[entry->second] : nullptr;
+}
+
+bool Manifest::Unchanged(const std::string& path, uint32_t size, uint64_t hash) const {
+	const Entry* entry = Find(path);
+	return mFingerprints && entry != nullptr && entry->size == size && entry->hash == hash;
+}
+
+Manifest::Diff Manifest::Compare(const Manifest& before, const Manifest& after){
+	Diff diff;
+	bool fingerprints = before.mFingerprints && after.mFingerprints;
+
+	for(auto& entry : after.mEntries){
+		const Entry* old = before.Find(entry.path);
+		if(old == nullptr){
+			diff.added.push_back(entry.path);
+		} else if(!fingerprints || old->size != entry.size || old->hash != entry.hash){
+			diff.changed.push_back(entry.path);
+		}
+	}
+
+	for(auto& entry : before.mEntries){
+		if(after.Find(entry.path) == nullptr){
+			diff.removed.push_back(entry.path);
+		}
+	}
+
+	return diff;
+}
+
+bool Manifest::Save(std::filesystem::path path){
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if(!out){
+		std::cout << "Couldn't write manifest " << path << std::endl;
+		return false;
+	}
+
+	std::sort(mEntries.begin(), mEntries.end(), [](const Entry& a, const Entry& b){ return a.id < b.id; });
+	Reindex();
+
+	out << (mFingerprints ? Header : HeaderV1) << '\n';
+	char hash[17];
+	for(auto& entry : mEntries){
+		if(!mFingerprints){
+			out << entry.id << '\t' << entry.path << '\n';
+			continue;
+		}
+		std::snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(entry.hash));
+		out << entry.id << '\t' << entry.size << '\t' << hash << '\t' << entry.path << '\n';
+	}
+
+	return out.good();
+}
+
+bool Manifest::Load(std::filesystem::path path){
+	std::ifstream in(path, std::ios::binary);
+	if(!in){
+		return false;
+	}
+
+	std::string line;
+	std::getline(in, line);
+	bool fingerprints = line == Header;
+	if(!fingerprints && line != HeaderV1){
+		std::cout << "Unknown manifest format in " << path << std::endl;
+		return false;
+	}
+
+	mEntries.clear();
+	mFingerprints = fingerprints;
+	while(std::getline(in, line)){
+		std::string_view rest = line;
+		Entry entry { 0, 0, 0 };
+
+		if(!Field(rest, entry.id) || (fingerprints && (!Field(rest, entry.size) || !Field(rest, entry.hash, 16)))){
+			std::cout << "Skipping bad manifest line: " << line << std::endl;
+			continue;
+		}
+
+		entry.path = rest;
+		mEntries.push_back(std::move(entry));
+	}
+
+	Reindex();
+	return true;
+}
+
+}
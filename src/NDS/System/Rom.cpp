@@ -3,6 +3,11 @@
 #include "Util.hpp"
 #include <format>
 #include <cstddef>
+#include <thread>
+#include <atomic>
+#include <unordered_set>
+#include <optional>
+#include <utility>
 
 namespace Palkia::Nitro {
 
@@ -37,20 +42,140 @@ void Rom::GetRawIcon(Color out[32][32]){
 	}
 }
 
-Rom::Rom(std::filesystem::path p){
+static uint32_t BannerSize(uint16_t version){
+	switch(version){
+		case 0x0002: return 0x940;
+		case 0x0003: return 0xA40;
+		case 0x0103: return 0x23C0;
+		default: return sizeof(Banner);
+	}
+}
+
+std::vector<uint8_t> Rom::BannerData(){
+	std::vector<uint8_t> banner(sizeof(Banner) + mBannerExtra.size());
+	memcpy(banner.data(), &mBanner, sizeof(Banner));
+	std::copy(mBannerExtra.begin(), mBannerExtra.end(), banner.begin() + sizeof(Banner));
+	return banner;
+}
+
+std::array<uint16_t, 4> Rom::BannerChecksums(std::vector<uint8_t>& banner){
+	std::array<uint16_t, 4> crcs = { mBanner.crc16_part1, mBanner.crc16_part2, mBanner.crc16_part3, mBanner.crc16_part4 };
+
+	// each version's crc covers everything up to the end of its titles, the dsi one just the animated icon
+	crcs[0] = Crc16(banner.data() + 0x20, 0x820);
+	if(banner.size() >= 0x940) crcs[1] = Crc16(banner.data() + 0x20, 0x920);
+	if(banner.size() >= 0xA40) crcs[2] = Crc16(banner.data() + 0x20, 0xA20);
+	if(banner.size() >= 0x23C0) crcs[3] = Crc16(banner.data() + 0x1240, 0x1180);
+
+	return crcs;
+}
+
+bool Rom::SecureArea(RomHeader& header, std::array<uint8_t, 0x4000>& area){
+	area.fill(0);
+
+	auto arm9 = mRomFiles->GetFile("arm9.bin");
+	if(arm9 == nullptr){
+		return false;
+	}
+
+	// copies whatever part of [offset, offset + size) lands in 0x4000-0x8000
+	auto place = [&](uint32_t offset, uint32_t size, std::function<void(uint32_t, uint8_t*, uint32_t)> read){
+		uint32_t start = std::max<uint32_t>(offset, 0x4000);
+		uint32_t end = std::min<uint32_t>(offset + size, 0x8000);
+		if(start < end){
+			read(start - offset, area.data() + (start - 0x4000), end - start);
+		}
+	};
+
+	place(header.arm9RomOff, arm9->GetSize(), [&](uint32_t from, uint8_t* dst, uint32_t size){ arm9->ReadBytes(from, dst, size); });
+
+	if(mNitroFooter[0] == 0xDEC00621){
+		place(header.arm9RomOff + arm9->GetSize(), sizeof(mNitroFooter), [&](uint32_t from, uint8_t* dst, uint32_t size){
+			memcpy(dst, reinterpret_cast<uint8_t*>(mNitroFooter.data()) + from, size);
+		});
+	}
+
+	// decrypted dumps start with this marker, their stored crc is for the encrypted data
+	static const uint8_t decrypted[8] = { 0xFF, 0xDE, 0xFF, 0xE7, 0xFF, 0xDE, 0xFF, 0xE7 };
+	return memcmp(area.data(), decrypted, sizeof(decrypted)) != 0;
+}
+
+void Rom::UpdateChecksums(RomHeader& header){
+	header.nintendoLogoChecksum = Crc16(header.nintendoLogoData, sizeof(header.nintendoLogoData));
+
+	std::array<uint8_t, 0x4000> area;
+	if(SecureArea(header, area)){
+		header.secureAreaCRC = Crc16(area.data(), area.size());
+	}
+
+	header.headerChecksum = Crc16(reinterpret_cast<uint8_t*>(&header), offsetof(RomHeader, headerChecksum));
+}
+
+RomChecksums Rom::Verify(){
+	RomChecksums result;
+
+	result.header = Crc16(reinterpret_cast<uint8_t*>(&mHeader), offsetof(RomHeader, headerChecksum)) == mHeader.headerChecksum;
+	result.logo = Crc16(mHeader.nintendoLogoData, sizeof(mHeader.nintendoLogoData)) == mHeader.nintendoLogoChecksum;
+
+	std::array<uint8_t, 0x4000> area;
+	if(SecureArea(mHeader, area)){
+		result.secureAreaChecked = true;
+		result.secureArea = Crc16(area.data(), area.size()) == mHeader.secureAreaCRC;
+	}
+
+	std::vector<uint8_t> banner = BannerData();
+	result.banner = BannerChecksums(banner) == std::array<uint16_t, 4>{ mBanner.crc16_part1, mBanner.crc16_part2, mBanner.crc16_part3, mBanner.crc16_part4 };
+
+	return result;
+}
+
+std::shared_ptr<File> Rom::ReadFile(bStream::CStream& romFile, uint32_t id, uint32_t start, uint32_t end){
+	if(mImage != nullptr){
+		return mImage->IsMapped() ? File::Map(mImage, id, start, end) : File::Lazy(mImage, id, start, end);
+	}
+	return File::Load(romFile, id, start, end);
+}
+
+Rom::Rom(std::filesystem::path p, LoadMode mode){
 	if(std::filesystem::exists(p)){
-		bStream::CFileStream romFile(p, bStream::Endianess::Little, bStream::OpenMode::In);
+		mPath = p;
+
+		if(mode == LoadMode::Map){
+			mImage = Image::Map(p);
+			if(mImage == nullptr){
+				std::printf("Couldn't map %s, reading it instead.\n", p.filename().c_str());
+			}
+		} else if(mode == LoadMode::Lazy){
+			mImage = Image::Open(p);
+		}
+
+		std::unique_ptr<bStream::CStream> stream;
+		if(mImage != nullptr && mImage->IsMapped()){
+			stream = std::make_unique<bStream::CMemoryStream>(mImage->GetData(), mImage->GetSize(), bStream::Endianess::Little, bStream::OpenMode::In);
+		} else {
+			stream = std::make_unique<bStream::CFileStream>(p, bStream::Endianess::Little, bStream::OpenMode::In);
+		}
+		bStream::CStream& romFile = *stream;
+
 		mHeader = romFile.readStruct<RomHeader>();
 		romFile.seek(mHeader.iconBannerOffset, false);
 		mBanner = romFile.readStruct<Banner>();
 
+		uint32_t bannerSize = BannerSize(mBanner.version);
+		if(bannerSize > sizeof(Banner) && mHeader.iconBannerOffset + bannerSize <= romFile.getSize()){
+			mBannerExtra.resize(bannerSize - sizeof(Banner));
+			romFile.readBytesTo(mBannerExtra.data(), mBannerExtra.size());
+		}
+
 		std::cout << "Reading FAT at " << std::hex << mHeader.FATOffset << std::dec << std::endl;
 		romFile.seek(mHeader.FATOffset);
 		std::vector<std::shared_ptr<File>> files;
 		uint32_t id = 0;
-		for(auto file : mFS.ParseFAT(romFile, (mHeader.FATSize / 8))){
-			files.push_back(File::Load(romFile, id++, file.first, file.second));
+		mFAT = mFS.ParseFAT(romFile, (mHeader.FATSize / 8));
+		for(auto file : mFAT){
+			files.push_back(ReadFile(romFile, id++, file.first, file.second));
 		}
+		mFATFiles.assign(files.begin(), files.end());
 
 		romFile.seek(mHeader.FNTOffset);
 		mFS.mRoot = mFS.ParseFNT(romFile, mHeader.FNTSize, files);
@@ -58,23 +183,21 @@ Rom::Rom(std::filesystem::path p){
 		// fucking whatever.
 		//std::sort(files.begin(), files.end(), [](std::shared_ptr<File> a, std::shared_ptr<File> b){ return a->GetID() < b->GetID(); });
 
-		romFile.seek(mHeader.arm9RomOff);
-		uint8_t* arm9Data = new uint8_t[mHeader.arm9Size];
-		romFile.readBytesTo(arm9Data, mHeader.arm9Size);
+		auto arm9 = ReadFile(romFile, 0, mHeader.arm9RomOff, mHeader.arm9RomOff + mHeader.arm9Size);
+		arm9->SetName("arm9.bin");
 
+		romFile.seek(mHeader.arm9RomOff + mHeader.arm9Size);
 		if(romFile.peekUInt32(romFile.tell()) == 0xDEC00621){
 			mNitroFooter[0] = romFile.readUInt32();
 			mNitroFooter[1] = romFile.readUInt32();
 			mNitroFooter[2] = romFile.readUInt32();
 		}
 
-		romFile.seek(mHeader.arm7RomOff);
-		uint8_t* arm7Data = new uint8_t[mHeader.arm7Size];
-		romFile.readBytesTo(arm7Data, mHeader.arm7Size);
+		auto arm7 = ReadFile(romFile, 0, mHeader.arm7RomOff, mHeader.arm7RomOff + mHeader.arm7Size);
+		arm7->SetName("arm7.bin");
 
-		romFile.seek(mHeader.debugRomOffset);
-		uint8_t* debugRomData = new uint8_t[mHeader.debugRomSize];
-		romFile.readBytesTo(debugRomData, mHeader.debugRomSize);
+		auto debugRom = ReadFile(romFile, 0, mHeader.debugRomOffset, mHeader.debugRomOffset + mHeader.debugRomSize);
+		debugRom->SetName("debug.nds");
 
 		mRomFiles = std::make_shared<Folder>();
 
@@ -85,21 +208,8 @@ Rom::Rom(std::filesystem::path p){
 		auto overlay7Dir = std::make_shared<Folder>();
 		overlay7Dir->SetName("overlays7");
 		mRomFiles->AddFolder(overlay7Dir);
-		
-		auto arm9 = File::Create();
-		arm9->SetName("arm9.bin");
-		arm9->SetData(arm9Data, mHeader.arm9Size);
 
-		auto arm7 = File::Create();
-		arm7->SetName("arm7.bin");
-		arm7->SetData(arm7Data, mHeader.arm7Size);
-
-		if(debugRomData != 0){
-			auto debugRom = File::Create();
-			debugRom->SetName("debug.nds");
-			debugRom->SetData(debugRomData, mHeader.debugRomSize);
-			mRomFiles->AddFile(debugRom);
-		}
+		mRomFiles->AddFile(debugRom);
 
 		mRomFiles->AddFile(arm9);
 		mRomFiles->AddFile(arm7);
@@ -161,202 +271,617 @@ Rom::Rom(std::filesystem::path p){
 			romFile.readBytesTo(mRsaSig.data(), rsaSigOffset + 0x88 > romFile.getSize() ? romFile.getSize() - rsaSigOffset : rsaSigOffset + 0x88);
 			mHasSig = true;
 		}
-
-		delete[] arm9Data;
-		delete[] arm7Data;
-		delete[] debugRomData;
 	} else {
 		std::printf("File %s not found.\n", p.filename().c_str());
 	}
 }
 
-void Rom::Save(std::filesystem::path p){
-	bStream::CFileStream romFile(p, bStream::Endianess::Little, bStream::OpenMode::Out);
+static std::vector<uint8_t> WriteOverlayTable(std::vector<Overlay>& overlays){
+	std::vector<uint8_t> table(overlays.size() * 0x20);
+	bStream::CMemoryStream tableStream(table.data(), table.size(), bStream::Endianess::Little, bStream::OpenMode::Out);
+
+	for (std::size_t i = 0; i < overlays.size(); i++){
+		tableStream.writeUInt32(overlays[i].overlayID);
+		tableStream.writeUInt32(overlays[i].ramAddress);
+		tableStream.writeUInt32(overlays[i].ramSize);
+		tableStream.writeUInt32(overlays[i].bssSize);
+		tableStream.writeUInt32(overlays[i].staticInitStart);
+		tableStream.writeUInt32(overlays[i].staticInitEnd);
+		tableStream.writeUInt32(overlays[i].fileID);
+		tableStream.writeUInt32((overlays[i].compressedSize & 0xFFFFFF) | (overlays[i].flags << 24));
+	}
+
+	return table;
+}
+
+void Rom::Layout(RomLayout& layout){
+	RomHeader& header = layout.header;
+	header = mHeader;
+
+	uint32_t cursor = 0x4000;
+
+	auto align = [&](uint32_t alignment){
+		uint32_t padding = Pad(cursor, alignment);
+		if(padding != 0){
+			layout.segments.push_back({ .offset = cursor, .size = padding });
+		}
+		cursor += padding;
+	};
+
+	auto placeFile = [&](std::shared_ptr<File> file){
+		uint32_t offset = cursor;
+		layout.segments.push_back({ .offset = cursor, .size = file->GetSize(), .file = file });
+		cursor += file->GetSize();
+		return offset;
+	};
+
+	auto placeData = [&](uint8_t* data, uint32_t size){
+		uint32_t offset = cursor;
+		layout.segments.push_back({ .offset = cursor, .size = size, .data = data });
+		cursor += size;
+		return offset;
+	};
 
-	romFile.seek(0x4000);
 	auto arm9 = mRomFiles->GetFile("arm9.bin");
 	if(arm9){
-		mHeader.arm9RomOff = romFile.tell();
-		mHeader.arm9Size = arm9->GetSize();
-		romFile.writeBytes(arm9->GetData(), arm9->GetSize());
+		header.arm9Size = arm9->GetSize();
+		header.arm9RomOff = placeFile(arm9);
 	} else {
-		mHeader.arm9RomOff = 0;
-		mHeader.arm9Size = 0;
+		header.arm9RomOff = 0;
+		header.arm9Size = 0;
 	}
 
 	if(mNitroFooter[0] == 0xDEC00621){
-		romFile.writeUInt32(mNitroFooter[0]);
-		romFile.writeUInt32(mNitroFooter[1]);
-		romFile.writeUInt32(mNitroFooter[2]);
+		placeData(reinterpret_cast<uint8_t*>(mNitroFooter.data()), sizeof(mNitroFooter));
 	}
 
-	if(romFile.tell() < 0x8000){
-		romFile.seek(0x8000);
+	if(cursor < 0x8000){
+		cursor = 0x8000;
 	}
 
-
 	auto arm7 = mRomFiles->GetFile("arm7.bin");
 	if(arm7){
-		mHeader.arm7RomOff = romFile.tell();
-		mHeader.arm7Size = arm7->GetSize();
-		romFile.writeBytes(arm7->GetData(), arm7->GetSize());
+		header.arm7Size = arm7->GetSize();
+		header.arm7RomOff = placeFile(arm7);
+	} else {
+		header.arm7RomOff = 0;
+		header.arm7Size = 0;
+	}
+
+	layout.banner = BannerData();
+	std::array<uint16_t, 4> bannerCrcs = BannerChecksums(layout.banner);
+	memcpy(layout.banner.data() + offsetof(Banner, crc16_part1), bannerCrcs.data(), sizeof(bannerCrcs));
+
+	align(0x400);
+	header.iconBannerOffset = placeData(layout.banner.data(), layout.banner.size());
+
+	// overlays take the first FAT IDs like they do in retail roms, so the tree's IDs don't move around
+	std::vector<std::shared_ptr<File>> fatFiles;
+	layout.overlays9 = mOverlays9;
+	for (std::size_t i = 0; i < layout.overlays9.size(); i++){
+		if(auto file = layout.overlays9[i].file.lock()){
+			layout.overlays9[i].fileID = fatFiles.size();
+			fatFiles.push_back(file);
+		}
+	}
+
+	layout.overlays7 = mOverlays7;
+	for (std::size_t i = 0; i < layout.overlays7.size(); i++){
+		if(auto file = layout.overlays7[i].file.lock()){
+			layout.overlays7[i].fileID = fatFiles.size();
+			fatFiles.push_back(file);
+		}
+	}
+
+	FileTables tables;
+	tables.renumber = false;
+	layout.firstTreeID = fatFiles.size();
+	mFS.WriteTables(tables, layout.firstTreeID);
+	layout.fnt = std::move(tables.fnt);
+	fatFiles.insert(fatFiles.end(), tables.files.begin(), tables.files.end());
+
+	align(0x400);
+	header.FNTSize = layout.fnt.size();
+	header.FNTOffset = placeData(layout.fnt.data(), layout.fnt.size());
+
+	align(0x400);
+	layout.fat.resize(fatFiles.size() * 8);
+	header.FATSize = layout.fat.size();
+	header.FATOffset = placeData(layout.fat.data(), layout.fat.size());
+
+	uint32_t imageSize = 0;
+	std::vector<FileSlot> slots = FileSystem::LayoutFiles(fatFiles, 1, mDeduplicate, imageSize);
+
+	bStream::CMemoryStream fatStream(layout.fat.data(), layout.fat.size(), bStream::Endianess::Little, bStream::OpenMode::Out);
+	for(std::size_t i = 0; i < fatFiles.size(); i++){
+		if(!slots[i].duplicate){
+			layout.segments.push_back({ .offset = cursor + slots[i].start, .size = fatFiles[i]->GetSize(), .file = fatFiles[i] });
+		}
+		fatStream.writeUInt32(cursor + slots[i].start);
+		fatStream.writeUInt32(cursor + slots[i].end);
+	}
+	cursor += imageSize;
+	layout.files = std::move(fatFiles);
+
+	align(0x400);
+
+	if(layout.overlays9.size() > 0){
+		layout.overlayTable9 = WriteOverlayTable(layout.overlays9);
+		header.arm9OverlaySize = layout.overlayTable9.size();
+		header.arm9OverlayOffset = placeData(layout.overlayTable9.data(), layout.overlayTable9.size());
 	} else {
-		mHeader.arm7RomOff = 0;
-		mHeader.arm7Size = 0;
+		header.arm9OverlayOffset = 0;
+		header.arm9OverlaySize = 0;
 	}
-	
-	while((romFile.tell() % 0x400) != 0) romFile.writeUInt8(0xFF);
 
-	mHeader.iconBannerOffset = romFile.tell();
-	romFile.writeBytes((uint8_t*)&mBanner, sizeof(mBanner)); // this can change for dsi but idc rn oops
+	align(0x400);
 
-	// Messy but it works
-	uint32_t fntSize = mFS.CalculateFNTSize();
+	if(layout.overlays7.size() > 0){
+		layout.overlayTable7 = WriteOverlayTable(layout.overlays7);
+		header.arm7OverlaySize = layout.overlayTable7.size();
+		header.arm7OverlayOffset = placeData(layout.overlayTable7.data(), layout.overlayTable7.size());
+	} else {
+		header.arm7OverlayOffset = 0;
+		header.arm7OverlaySize = 0;
+	}
 
-	uint8_t* fntData = new uint8_t[fntSize](0xFF);
-	bStream::CMemoryStream fntStream(fntData, fntSize, bStream::Endianess::Little, bStream::OpenMode::Out);
-	mFS.WriteFNT(fntStream); // this resets all file ids, this should probably be its own function - regenerate IDs or something - that gets called whenever a modification happens to the filesystem
+	align(0x400);
 
-	while((romFile.tell() % 0x400) != 0) romFile.writeUInt8(0xFF);
-	mHeader.FNTOffset = romFile.tell();
-	mHeader.FNTSize = fntSize;
-	romFile.writeBytes(fntData, fntSize);
-	
-	delete[] fntData;
-	
-	while((romFile.tell() % 0x400) != 0) romFile.writeUInt8(0xFF);
-	mHeader.FATOffset = romFile.tell();
-	mHeader.FATSize = mFS.CalculateFATSize() + (mOverlays9.size() * 8) + (mOverlays7.size() * 8);
-	romFile.seek(romFile.tell() + mHeader.FATSize);
+	auto debugRom = mRomFiles->GetFile("debug.nds");
+	if(debugRom != nullptr){
+		header.debugRomSize = debugRom->GetSize();
+		header.debugRomOffset = placeFile(debugRom);
+	} else {
+		header.debugRomOffset = 0;
+		header.debugRomSize = 0;
+	}
 
-	std::vector<std::pair<uint32_t, uint32_t>> tempFAT = {};
-	
-	mFS.ForEachFile([&](std::shared_ptr<Palkia::Nitro::File> file){
-		std::pair<uint32_t, uint32_t> fatEntry {romFile.tell(), 0};
-		romFile.writeBytes(file->GetData(), file->GetSize());
-		fatEntry.second = romFile.tell();
+	align(0x400);
 
-		tempFAT.push_back(fatEntry);
-	});
+	header.totalUsedRom = cursor;
 
-	for (std::size_t i = 0; i < mOverlays9.size(); i++){
-		// Setup the overlay
-		if(mOverlays9[i].file.lock()){
-			auto file = mOverlays9[i].file.lock();
+	header.devCapacity = 0;
 
-			mOverlays9[i].fileID = tempFAT.size();
+	while(((uint64_t)128000 << (uint64_t)header.devCapacity) < header.totalUsedRom) { header.devCapacity += 1; }
 
-			//write the file and add it to the FAT
-			std::pair<uint32_t, uint32_t> fatEntry {romFile.tell(), 0};
-			romFile.writeBytes(file->GetData(), file->GetSize());
-			fatEntry.second = romFile.tell();
+	UpdateChecksums(header);
 
-			tempFAT.push_back(fatEntry);
+	layout.segments.push_back({ .offset = 0, .size = sizeof(RomHeader), .data = reinterpret_cast<uint8_t*>(&layout.header) });
+	layout.size = cursor;
+}
+
+bool Rom::Save(std::filesystem::path p, uint32_t threads){
+	// fifos and devices can't be preallocated or written out of order
+	if(std::filesystem::exists(p) && !std::filesystem::is_regular_file(p)){
+		RomLayout layout;
+		Layout(layout);
+
+		bStream::CFileStream romFile(p, bStream::Endianess::Little, bStream::OpenMode::Out);
+		return WriteLayout(layout, romFile);
+	}
+
+	// only a save over the image itself changes what Patch has to work against
+	std::error_code err;
+	bool overImage = !mPath.empty() && std::filesystem::equivalent(p, mPath, err);
+
+	RomLayout layout;
+	Layout(layout);
+	if(!WriteLayout(layout, p, threads)){
+		return false;
+	}
+
+	if(overImage){
+		OnDisk(layout);
+	}
+	return true;
+}
+
+bool Rom::Save(bStream::CStream& stream){
+	RomLayout layout;
+	Layout(layout);
+	return WriteLayout(layout, stream);
+}
+
+std::optional<bStream::CMemoryStream> Rom::Save(){
+	RomLayout layout;
+	Layout(layout);
+
+	bStream::CMemoryStream stream(layout.size, bStream::Endianess::Little, bStream::OpenMode::Out);
+	if(!WriteLayout(layout, stream)){
+		return std::nullopt;
+	}
+	return stream;
+}
+
+bool Rom::WriteLayout(RomLayout& layout, bStream::CStream& stream){
+	std::stable_sort(layout.segments.begin(), layout.segments.end(), [](const RomSegment& a, const RomSegment& b){ return a.offset < b.offset; });
+
+	std::vector<uint8_t> scratch;
+	auto fill = [&](uint32_t size, uint8_t value){
+		scratch.assign(std::min<uint32_t>(size, 0x10000), value);
+		for(uint32_t written = 0; written < size; written += scratch.size()){
+			stream.writeBytes(scratch.data(), std::min<uint32_t>(size - written, scratch.size()));
 		}
+	};
+
+	uint32_t cursor = 0;
+	for(RomSegment& segment : layout.segments){
+		// anything the layout skipped over is zeroed, same as the holes Save(path) leaves
+		if(segment.offset > cursor){
+			fill(segment.offset - cursor, 0x00);
+		}
+
+		if(segment.file != nullptr && !segment.file->IsLoaded()){
+			scratch.resize(std::min<uint32_t>(segment.size, 0x100000));
+			for(uint32_t read = 0; read < segment.size; read += scratch.size()){
+				uint32_t chunk = std::min<uint32_t>(segment.size - read, scratch.size());
+				if(!segment.file->ReadBytes(read, scratch.data(), chunk)){
+					std::printf("Couldn't read %s for saving.\n", segment.file->GetName().c_str());
+					return false;
+				}
+				stream.writeBytes(scratch.data(), chunk);
+			}
+		} else if(segment.file != nullptr){
+			stream.writeBytes(const_cast<uint8_t*>(std::as_const(*segment.file).GetData()), segment.size);
+		} else if(segment.data != nullptr){
+			stream.writeBytes(segment.data, segment.size);
+		} else {
+			fill(segment.size, segment.fill);
+		}
+
+		cursor = segment.offset + segment.size;
 	}
 
-	for (std::size_t i = 0; i < mOverlays7.size(); i++){
-		// Setup the overlay
-		if(mOverlays7[i].file.lock()){
-			auto file = mOverlays7[i].file.lock();
+	if(layout.size > cursor){
+		fill(layout.size - cursor, 0x00);
+	}
+	return true;
+}
+
+bool Rom::ReadsFrom(std::filesystem::path p){
+	std::error_code err;
+	if(!mPath.empty() && std::filesystem::equivalent(p, mPath, err)){
+		return true;
+	}
+
+	// files opened together share one image, so each only gets looked at once
+	std::unordered_set<Image*> checked;
+	bool reads = false;
+	auto check = [&](const std::shared_ptr<File>& file){
+		std::shared_ptr<Image> image = file->GetOrigin();
+		if(!reads && image != nullptr && checked.insert(image.get()).second){
+			reads = image->IsFile(p);
+		}
+	};
+
+	mFS.VisitFiles(check);
+	if(mRomFiles != nullptr){
+		mRomFiles->VisitFiles(check);
+	}
+	return reads;
+}
+
+bool Rom::WriteLayout(RomLayout& layout, std::filesystem::path p, uint32_t threads){
+	// write next to anything still being read from and swap it in, views into the old image stay valid that way
+	bool replace = ReadsFrom(p);
+	std::filesystem::path target = p;
+	if(replace){
+		target += ".tmp";
+	}
+
+	if(threads == 0){
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	std::atomic<bool> ok { true };
+	{
+		ImageWriter romFile;
+		if(!romFile.Open(target, layout.size)){
+			std::printf("Couldn't open %s for writing.\n", target.filename().c_str());
+			return false;
+		}
+
+		// every segment is independent once the layout is known, so workers just pull the next one
+		std::atomic<std::size_t> next { 0 };
+		auto writeSegments = [&](){
+			std::vector<uint8_t> scratch;
+			for(std::size_t i = next++; i < layout.segments.size() && ok; i = next++){
+				RomSegment& segment = layout.segments[i];
+				bool written;
+				if(segment.file != nullptr && !segment.file->IsLoaded()){
+					// don't keep lazily opened files around just because they were saved
+					scratch.resize(segment.size);
+					written = segment.file->ReadBytes(0, scratch.data(), segment.size) && romFile.Write(segment.offset, scratch.data(), segment.size);
+				} else if(segment.file != nullptr){
+					written = romFile.Write(segment.offset, std::as_const(*segment.file).GetData(), segment.size);
+				} else if(segment.data != nullptr){
+					written = romFile.Write(segment.offset, segment.data, segment.size);
+				} else {
+					written = romFile.Fill(segment.offset, segment.size, segment.fill);
+				}
+
+				if(!written){
+					ok = false;
+				}
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for(uint32_t t = 1; t < threads; t++){
+			workers.emplace_back(writeSegments);
+		}
+		writeSegments();
 
-			mOverlays7[i].fileID = tempFAT.size();
+		for(auto& worker : workers){
+			worker.join();
+		}
+	}
 
-			//write the file and add it to the FAT
-			std::pair<uint32_t, uint32_t> fatEntry {romFile.tell(), 0};
-			romFile.writeBytes(file->GetData(), file->GetSize());
-			fatEntry.second = romFile.tell();
+	std::error_code err;
+	if(ok && replace){
+		std::filesystem::rename(target, p, err);
+	}
 
-			tempFAT.push_back(fatEntry);
+	if(!ok || err){
+		std::printf("Couldn't write %s.\n", p.filename().c_str());
+		if(replace){
+			std::filesystem::remove(target, err);
 		}
+		return false;
 	}
 
-	while((romFile.tell() % 0x400) != 0) romFile.writeUInt8(0xFF);
+	return true;
+}
 
-	// Save our spot for writing the overlay data, we need to go back and write the FAT
-	if(mOverlays9.size() > 0){
-		mHeader.arm9OverlayOffset = romFile.tell();
-		mHeader.arm9OverlaySize = mOverlays9.size() * 0x20;
-	} else {
-		mHeader.arm9OverlayOffset = 0;
-		mHeader.arm9OverlaySize = 0;
+bool Rom::RebuildInPlace(){
+	RomLayout layout;
+	Layout(layout);
+	if(!WriteLayout(layout, mPath, 0)){
+		return false;
 	}
 
-	romFile.seek(mHeader.FATOffset);
-	for (auto [start, end] : tempFAT){
-		romFile.writeUInt32(start);
-		romFile.writeUInt32(end);
+	OnDisk(layout);
+	return true;
+}
+
+void Rom::OnDisk(RomLayout& layout){
+	mHeader = layout.header;
+
+	// IDs and crcs only follow a layout once it's what is on disk here, exports leave them be
+	memcpy(&mBanner, layout.banner.data(), sizeof(Banner));
+	for(std::size_t i = 0; i < mOverlays9.size() && i < layout.overlays9.size(); i++){
+		mOverlays9[i].fileID = layout.overlays9[i].fileID;
+	}
+	for(std::size_t i = 0; i < mOverlays7.size() && i < layout.overlays7.size(); i++){
+		mOverlays7[i].fileID = layout.overlays7[i].fileID;
 	}
 
-	romFile.seek(mHeader.arm9OverlayOffset);
+	FileTables tables;
+	mFS.WriteTables(tables, layout.firstTreeID);
+	mFS.SetIDTable(layout.files);
 
-	for (std::size_t i = 0; i < mOverlays9.size(); i++){
-		romFile.writeUInt32(mOverlays9[i].overlayID);
-		romFile.writeUInt32(mOverlays9[i].ramAddress);
-		romFile.writeUInt32(mOverlays9[i].ramSize);
-		romFile.writeUInt32(mOverlays9[i].bssSize);
-		romFile.writeUInt32(mOverlays9[i].staticInitStart);
-		romFile.writeUInt32(mOverlays9[i].staticInitEnd);
-		romFile.writeUInt32(mOverlays9[i].fileID);
-		romFile.writeUInt32(mOverlays9[i].compressedSize | ((mOverlays9[i].flags << 24) & 0xFF)); //bad
+	bStream::CMemoryStream fatStream(layout.fat.data(), layout.fat.size(), bStream::Endianess::Little, bStream::OpenMode::In);
+	mFAT = mFS.ParseFAT(fatStream, layout.fat.size() / 8);
+	mFATFiles.assign(layout.files.begin(), layout.files.end());
+
+	for(auto& file : layout.files){
+		file->ClearDirty();
 	}
+	mRomFiles->VisitFiles([](const std::shared_ptr<File>& file){ file->ClearDirty(); });
+}
 
-	while((romFile.tell() % 0x400) != 0) romFile.writeUInt8(0xFF);
+bool Rom::Patch(){
+	if(mPath.empty()){
+		return false;
+	}
 
-	if(mOverlays7.size() > 0){
-		mHeader.arm7OverlayOffset = romFile.tell();
-		mHeader.arm7OverlaySize = mOverlays7.size() * 0x20;
-	} else {
-		mHeader.arm7OverlayOffset = 0;
-		mHeader.arm7OverlaySize = 0;
-	}	
+	// Anything the FAT on disk doesn't already describe means the tables have to be rebuilt
+	bool matchesDisk = true;
+	auto checkFile = [&](std::shared_ptr<File> file, uint32_t id){
+		if(id >= mFATFiles.size() || mFATFiles[id].lock() != file){
+			matchesDisk = false;
+		}
+	};
 
+	mFS.VisitFiles([&](const std::shared_ptr<File>& file){ checkFile(file, file->GetID()); });
+	for(auto& overlay : mOverlays9){
+		if(auto file = overlay.file.lock()) checkFile(file, overlay.fileID);
+	}
+	for(auto& overlay : mOverlays7){
+		if(auto file = overlay.file.lock()) checkFile(file, overlay.fileID);
+	}
 
-	for (std::size_t i = 0; i < mOverlays7.size(); i++){
-		romFile.writeUInt32(mOverlays7[i].overlayID);
-		romFile.writeUInt32(mOverlays7[i].ramAddress);
-		romFile.writeUInt32(mOverlays7[i].ramSize);
-		romFile.writeUInt32(mOverlays7[i].bssSize);
-		romFile.writeUInt32(mOverlays7[i].staticInitStart);
-		romFile.writeUInt32(mOverlays7[i].staticInitEnd);
-		romFile.writeUInt32(mOverlays7[i].fileID);
-		romFile.writeUInt32(mOverlays7[i].compressedSize | ((mOverlays9[i].flags << 24) & 0xFF)); //bad
+	if(mOverlays9.size() * 0x20 != mHeader.arm9OverlaySize || mOverlays7.size() * 0x20 != mHeader.arm7OverlaySize){
+		matchesDisk = false;
 	}
 
-	while((romFile.tell() % 0x400) != 0) romFile.writeUInt8(0xFF);
+	// Everything that starts somewhere in the image, a slot runs up to the next one of these
+	std::vector<uint32_t> starts = {
+		mHeader.arm9RomOff, mHeader.arm7RomOff, mHeader.iconBannerOffset, mHeader.FNTOffset, mHeader.FATOffset,
+		mHeader.arm9OverlayOffset, mHeader.arm7OverlayOffset, mHeader.debugRomOffset, mHeader.totalUsedRom
+	};
+	for(auto [start, end] : mFAT){
+		starts.push_back(start);
+	}
+	std::sort(starts.begin(), starts.end());
+
+	auto slotFits = [&](uint32_t start, uint32_t size){
+		auto next = std::upper_bound(starts.begin(), starts.end(), start);
+		return next != starts.end() && start + size <= *next;
+	};
+
+	// a slot another FAT entry points into can't be overwritten
+	auto slotShared = [&](uint32_t id){
+		for(std::size_t other = 0; other < mFAT.size(); other++){
+			if(other != id && mFAT[other].first < mFAT[id].second && mFAT[id].first < mFAT[other].second){
+				return true;
+			}
+		}
+		return false;
+	};
 
+	auto arm9 = mRomFiles->GetFile("arm9.bin");
+	auto arm7 = mRomFiles->GetFile("arm7.bin");
 	auto debugRom = mRomFiles->GetFile("debug.nds");
-	if(debugRom != nullptr){
-		mHeader.debugRomOffset = romFile.tell();
-		mHeader.debugRomSize = debugRom->GetSize();
-		romFile.writeBytes(debugRom->GetData(), debugRom->GetSize());
-	} else {
-		mHeader.debugRomOffset = 0;
-		mHeader.debugRomSize = 0;
+	uint32_t footerSize = mNitroFooter[0] == 0xDEC00621 ? sizeof(mNitroFooter) : 0;
+
+	if((arm9 && arm9->IsDirty() && !slotFits(mHeader.arm9RomOff, arm9->GetSize() + footerSize)) ||
+	   (arm7 && arm7->IsDirty() && !slotFits(mHeader.arm7RomOff, arm7->GetSize())) ||
+	   (debugRom && debugRom->IsDirty() && !slotFits(mHeader.debugRomOffset, debugRom->GetSize()))){
+		matchesDisk = false;
+	}
+
+	if(!matchesDisk){
+		return RebuildInPlace();
+	}
+
+	ImageWriter romFile;
+	if(!romFile.Open(mPath)){
+		std::printf("Couldn't open %s for writing.\n", mPath.filename().c_str());
+		return false;
+	}
+
+	// Nothing here is committed until every write has gone through, a failed patch leaves the
+	// files dirty and the header and FAT as they were so it can be retried or saved elsewhere.
+	// The header goes out last, so the image on disk keeps its old one too.
+	RomHeader header = mHeader;
+	std::vector<std::pair<uint32_t, uint32_t>> fat = mFAT;
+	std::vector<std::shared_ptr<File>> patched;
+
+	auto write = [&](uint32_t offset, const uint8_t* data, uint32_t size){
+		if((data == nullptr && size != 0) || !romFile.Write(offset, data, size)){
+			std::printf("Couldn't write %s.\n", mPath.filename().c_str());
+			return false;
+		}
+		return true;
+	};
+
+	// grown files go after everything else, skipping a trailing RSA signature if there is one
+	uint32_t appendCursor = header.totalUsedRom;
+	if(auto original = Image::Open(mPath)){
+		uint8_t magic[2] = { 0, 0 };
+		if(original->Read(appendCursor, magic, sizeof(magic)) && magic[0] == 'a' && magic[1] == 'c'){
+			appendCursor += 0x88;
+		}
+	}
+	appendCursor += Pad(appendCursor, 0x200);
+
+	for(std::size_t id = 0; id < fat.size(); id++){
+		auto file = mFATFiles[id].lock();
+		if(file == nullptr || !file->IsDirty()){
+			continue;
+		}
+
+		uint32_t start = fat[id].first;
+		if(!slotFits(start, file->GetSize()) || slotShared(id)){
+			start = appendCursor;
+			appendCursor += file->GetSize();
+			appendCursor += Pad(appendCursor, 0x200);
+		}
+
+		fat[id] = { start, start + file->GetSize() };
+		uint32_t entry[2] = { fat[id].first, fat[id].second };
+		if(!write(start, std::as_const(*file).GetData(), file->GetSize()) || !write(header.FATOffset + (id * 8), reinterpret_cast<uint8_t*>(entry), sizeof(entry))){
+			return false;
+		}
+		patched.push_back(file);
+	}
+
+	if(appendCursor > header.totalUsedRom){
+		header.totalUsedRom = appendCursor;
+	}
+
+	if(arm9 && arm9->IsDirty()){
+		uint32_t oldEnd = header.arm9RomOff + header.arm9Size + footerSize;
+		header.arm9Size = arm9->GetSize();
+		if(!write(header.arm9RomOff, std::as_const(*arm9).GetData(), arm9->GetSize())){
+			return false;
+		}
+		if(footerSize != 0 && !write(header.arm9RomOff + arm9->GetSize(), reinterpret_cast<uint8_t*>(mNitroFooter.data()), footerSize)){
+			return false;
+		}
+
+		// the secure area crc is over what's on disk, so don't leave the old tail behind
+		uint32_t newEnd = header.arm9RomOff + header.arm9Size + footerSize;
+		if(newEnd < oldEnd && !romFile.Fill(newEnd, oldEnd - newEnd, 0x00)){
+			std::printf("Couldn't write %s.\n", mPath.filename().c_str());
+			return false;
+		}
+		patched.push_back(arm9);
 	}
 
-	while((romFile.tell() % 0x400) != 0) romFile.writeUInt8(0xFF);
-	
-	mHeader.totalUsedRom = romFile.tell();
-	
-	mHeader.devCapacity = 0;
-	
-	while(((uint64_t)128000 << (uint64_t)mHeader.devCapacity) < mHeader.totalUsedRom) { mHeader.devCapacity += 1; }
+	if(arm7 && arm7->IsDirty()){
+		header.arm7Size = arm7->GetSize();
+		if(!write(header.arm7RomOff, std::as_const(*arm7).GetData(), arm7->GetSize())){
+			return false;
+		}
+		patched.push_back(arm7);
+	}
 
-	// TODO: checksum
-	//mHeader.headerChecksum = 0xFFFF;
+	if(debugRom && debugRom->IsDirty()){
+		header.debugRomSize = debugRom->GetSize();
+		if(!write(header.debugRomOffset, std::as_const(*debugRom).GetData(), debugRom->GetSize())){
+			return false;
+		}
+		patched.push_back(debugRom);
+	}
 
-	romFile.seek(0x00);
-	romFile.writeBytes((uint8_t*)&mHeader, sizeof(mHeader));
+	// overlay entries are handed out by reference, so they may have been edited
+	if(mOverlays9.size() > 0){
+		std::vector<uint8_t> table = WriteOverlayTable(mOverlays9);
+		if(!write(header.arm9OverlayOffset, table.data(), table.size())){
+			return false;
+		}
+	}
+
+	if(mOverlays7.size() > 0){
+		std::vector<uint8_t> table = WriteOverlayTable(mOverlays7);
+		if(!write(header.arm7OverlayOffset, table.data(), table.size())){
+			return false;
+		}
+	}
+
+	while(((uint64_t)128000 << (uint64_t)header.devCapacity) < header.totalUsedRom) { header.devCapacity += 1; }
+
+	UpdateChecksums(header);
+	if(!write(0, reinterpret_cast<uint8_t*>(&header), sizeof(header))){
+		return false;
+	}
+
+	mHeader = header;
+	mFAT = std::move(fat);
+	for(auto& file : patched){
+		file->ClearDirty();
+	}
+	return true;
 }
 
 Rom::~Rom(){}
 
-void Rom::Dump(){
+void Rom::Dump(uint32_t threads){
 	std::string name = std::string(mHeader.romID);
 	std::replace(name.begin(), name.end(), ' ', '_');
-    std::filesystem::create_directory(name);
-	mFS.GetRoot()->Dump("");
+	mFS.Dump(name, threads);
+}
+
+std::shared_ptr<const Snapshot> Rom::GetSnapshot(){
+	std::shared_ptr<const Snapshot> snapshot = mSnapshot.load(std::memory_order_acquire);
+	if(snapshot != nullptr){
+		return snapshot;
+	}
+
+	// first use, whichever thread loses the race takes the winner's
+	std::shared_ptr<const Snapshot> taken = Snapshot::Take(mFS);
+	if(mSnapshot.compare_exchange_strong(snapshot, taken, std::memory_order_acq_rel)){
+		return taken;
+	}
+	return snapshot;
+}
+
+std::shared_ptr<const Snapshot> Rom::Publish(){
+	std::shared_ptr<const Snapshot> snapshot = Snapshot::Take(mFS);
+	mSnapshot.store(snapshot, std::memory_order_release);
+	return snapshot;
 }
 
 
@@ -0,0 +1,54 @@
+#include "NDS/System/Snapshot.hpp"
+
+namespace Palkia::Nitro {
+
+std::shared_ptr<const File> Snapshot::GetFile(std::filesystem::path path) const {
+	auto entry = mByPath.find(PathIndex::Key(path));
+	return entry != mByPath.end() ? mFiles[entry->second].second : nullptr;
+}
+
+std::shared_ptr<const Snapshot> Snapshot::Take(FileSystem& fs){
+	std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+
+	std::vector<std::filesystem::path> dirs;
+	std::vector<std::pair<std::filesystem::path, File*>> files;
+	fs.ListTree("", dirs, files);
+
+	// the same frozen file whether it's reached by path or by ID
+	std::unordered_map<File*, std::shared_ptr<const File>> frozen;
+	auto freeze = [&](File* file){
+		std::shared_ptr<const File>& copy = frozen[file];
+		if(copy == nullptr){
+			std::shared_ptr<File> slice = File::Slice(file->GetPtr(), file->GetID(), 0, file->GetSize());
+			slice->SetName(file->GetName());
+
+			// Payloads the slice views rather than reads for itself become copy on write, the
+			// live file copies before it's next edited. Its edits never reach these bytes, so
+			// the slice doesn't have to follow it.
+			if(slice->mStorage != nullptr && slice->mStorage == file->mStorage){
+				file->mShared = true;
+				slice->mSliceOf = nullptr;
+			}
+			copy = slice;
+		}
+		return copy;
+	};
+
+	snapshot->mFiles.reserve(files.size());
+	for(auto& [path, file] : files){
+		snapshot->mByPath[path.generic_string()] = snapshot->mFiles.size();
+		snapshot->mFiles.push_back({ path.generic_string(), freeze(file) });
+	}
+
+	if(fs.mIndex != nullptr){
+		snapshot->mByID.reserve(fs.mIndex->ids.size());
+		for(auto& id : fs.mIndex->ids){
+			std::shared_ptr<File> file = id.lock();
+			snapshot->mByID.push_back(file != nullptr ? freeze(file.get()) : nullptr);
+		}
+	}
+
+	return snapshot;
+}
+
+}
@@ -1,7 +1,98 @@
 #include <Util.hpp>
+#include <array>
+#include <cstring>
 
 namespace Palkia {
 
+namespace {
+
+// Slice-by-8 tables, table[k][b] is the crc of b followed by k zero bytes
+struct Crc16Tables {
+    std::array<std::array<uint16_t, 256>, 8> table {};
+
+    constexpr Crc16Tables(){
+        for(uint32_t b = 0; b < 256; b++){
+            uint16_t crc = b;
+            for(int bit = 0; bit < 8; bit++){
+                crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+            }
+            table[0][b] = crc;
+        }
+
+        for(int k = 1; k < 8; k++){
+            for(uint32_t b = 0; b < 256; b++){
+                table[k][b] = (table[k-1][b] >> 8) ^ table[0][table[k-1][b] & 0xFF];
+            }
+        }
+    }
+};
+
+constexpr Crc16Tables crc16Tables;
+
+constexpr uint64_t XXH_P1 = 11400714785074694791ULL;
+constexpr uint64_t XXH_P2 = 14029467366897019727ULL;
+constexpr uint64_t XXH_P3 = 1609587929392839161ULL;
+constexpr uint64_t XXH_P4 = 9650029242287828579ULL;
+constexpr uint64_t XXH_P5 = 2870177450012600261ULL;
+
+inline uint64_t rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const uint8_t* p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t read32(const uint8_t* p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t xxhRound(uint64_t acc, uint64_t input){
+    acc += input * XXH_P2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+inline uint64_t xxhMerge(uint64_t acc, uint64_t lane){
+    acc ^= xxhRound(0, lane);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+// everything after the 32 byte stripes, then the final avalanche
+uint64_t xxhFinish(uint64_t h, const uint8_t* p, std::size_t size){
+    while(size >= 8){
+        h ^= xxhRound(0, read64(p));
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+        size -= 8;
+    }
+
+    if(size >= 4){
+        h ^= (uint64_t)read32(p) * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        size -= 4;
+    }
+
+    while(size-- > 0){
+        h ^= (*p++) * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+}
+
 uint8_t cv3To8(uint8_t v){
     return (v << 5) | (v << 2) | (v >> 1);
 }
@@ -22,5 +113,85 @@ uint32_t Pad(uint32_t x, uint32_t y){
     return ((x % y) != 0 ? y - (x % y) : 0);
 }
 
+uint16_t Crc16(const uint8_t* data, std::size_t size, uint16_t crc){
+    const auto& t = crc16Tables.table;
+
+    while(size >= 8){
+        uint32_t lo = (data[0] | (data[1] << 8)) ^ crc;
+        crc = t[7][lo & 0xFF] ^ t[6][lo >> 8] ^ t[5][data[2]] ^ t[4][data[3]] ^
+              t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+        data += 8;
+        size -= 8;
+    }
+
+    while(size-- > 0){
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+
+    return crc;
+}
+
+uint64_t Hash64(const uint8_t* data, std::size_t size, uint64_t seed){
+    Hasher64 hasher(seed);
+    hasher.Update(data, size);
+    return hasher.Digest();
+}
+
+Hasher64::Hasher64(uint64_t seed) : mSeed(seed) {
+    mLanes[0] = seed + XXH_P1 + XXH_P2;
+    mLanes[1] = seed + XXH_P2;
+    mLanes[2] = seed;
+    mLanes[3] = seed - XXH_P1;
+}
+
+void Hasher64::Update(const uint8_t* data, std::size_t size){
+    mTotal += size;
+
+    if(mBuffered + size < 32){
+        memcpy(mBuffer + mBuffered, data, size);
+        mBuffered += size;
+        return;
+    }
+
+    if(mBuffered > 0){
+        std::size_t fill = 32 - mBuffered;
+        memcpy(mBuffer + mBuffered, data, fill);
+        for(int l = 0; l < 4; l++){
+            mLanes[l] = xxhRound(mLanes[l], read64(mBuffer + l * 8));
+        }
+        data += fill;
+        size -= fill;
+        mBuffered = 0;
+    }
+
+    while(size >= 32){
+        mLanes[0] = xxhRound(mLanes[0], read64(data));
+        mLanes[1] = xxhRound(mLanes[1], read64(data + 8));
+        mLanes[2] = xxhRound(mLanes[2], read64(data + 16));
+        mLanes[3] = xxhRound(mLanes[3], read64(data + 24));
+        data += 32;
+        size -= 32;
+    }
+
+    memcpy(mBuffer, data, size);
+    mBuffered = size;
+}
+
+uint64_t Hasher64::Digest(){
+    uint64_t h;
+
+    if(mTotal >= 32){
+        h = rotl64(mLanes[0], 1) + rotl64(mLanes[1], 7) + rotl64(mLanes[2], 12) + rotl64(mLanes[3], 18);
+        for(int l = 0; l < 4; l++){
+            h = xxhMerge(h, mLanes[l]);
+        }
+    } else {
+        h = mSeed + XXH_P5;
+    }
+
+    h += mTotal;
+    return xxhFinish(h, mBuffer, mBuffered);
+}
+
 
 }
\ No newline at end of file